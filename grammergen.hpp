@@ -15,237 +15,3525 @@
 #include <type_traits>
 #include <deque>
 #include <regex>
+#include <unordered_map>
+#include <unordered_set>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <bitset>
+#include <limits>
+#include <utility>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#endif
 
 namespace grammergen {
 
-class context {
-public:
-    std::size_t match_count{};
-    std::size_t compare_count{};
-};
+auto count_trailing_zeros(std::uint64_t bits) -> std::size_t {
+#if defined(__GNUC__) || defined(__clang__)
+    return static_cast<std::size_t>(__builtin_ctzll(bits));
+#else
+    std::size_t n = 0;
+    while (!(bits & 1)) {
+        bits >>= 1;
+        ++n;
+    }
+    return n;
+#endif
+}
 
-template<typename T>
-using evaluated = std::pair<T, double>;
+auto count_bits(std::uint64_t bits) -> std::size_t {
+#if defined(__GNUC__) || defined(__clang__)
+    return static_cast<std::size_t>(__builtin_popcountll(bits));
+#else
+    std::size_t n = 0;
+    for (; bits; bits &= bits - 1)
+        ++n;
+    return n;
+#endif
+}
 
-class grammer : public std::enable_shared_from_this<grammer> {
+// 64-bit FNV-1a.
+auto hash_bytes(std::string_view bytes) -> std::uint64_t {
+    std::uint64_t h = 0xcbf29ce484222325ull;
+    for (const auto c : bytes) {
+        h ^= static_cast<unsigned char>(c);
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+// Order-sensitive combination of two hashes, finished with the splitmix64
+// mixer so that similar inputs spread over all bits.
+auto hash_combine(std::uint64_t seed, std::uint64_t value) -> std::uint64_t {
+    auto h = seed ^ (value + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2));
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+    return h ^ (h >> 31);
+}
+
+// True if str begins with lit. The length is checked before any byte is read,
+// and literals of exactly 8, 16 or 32 bytes are compared with single loads.
+auto starts_with_literal(std::string_view str, std::string_view lit) -> bool {
+    const auto n = lit.size();
+    if (str.size() < n)
+        return false;
+    const auto * a = str.data();
+    const auto * b = lit.data();
+    switch (n) {
+    case 0:
+        return true;
+    case 1:
+        return *a == *b;
+    case 8: {
+        std::uint64_t x, y;
+        std::memcpy(&x, a, 8);
+        std::memcpy(&y, b, 8);
+        return x == y;
+    }
+#if defined(__SSE2__)
+    case 16: {
+        const auto x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a));
+        const auto y = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b));
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) == 0xffff;
+    }
+#endif
+#if defined(__AVX2__)
+    case 32: {
+        const auto x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a));
+        const auto y = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b));
+        return static_cast<std::uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y))) == 0xffffffffu;
+    }
+#endif
+    default:
+        return std::memcmp(a, b, n) == 0;
+    }
+}
+
+// Deduplicated set of end offsets into one input, stored as a bitset with
+// one bit per offset in [0, input size]. Inputs of up to 255 bytes fit in the
+// inline words, so the common case never touches the heap.
+class offset_set {
 public:
-    grammer() {}
+    static constexpr std::size_t inline_words = 4;
 
-    grammer(
-        const std::shared_ptr<grammer> & first,
-        const std::shared_ptr<grammer> & second
-    )
-        : first{first}
-        , second{second}
-    {}
+    offset_set() {}
 
-    virtual ~grammer() {}
+    explicit offset_set(std::size_t input_size)
+        : _word_number{input_size / 64 + 1}
+    {
+        if (_word_number > inline_words)
+            _heap.resize(_word_number);
+    }
 
-    virtual auto parse(std::string_view, context & ctx) const -> std::vector<std::string_view> = 0;
+    auto insert(std::size_t offset) -> void {
+        data()[offset / 64] |= std::uint64_t{1} << (offset % 64);
+    }
 
-    virtual auto size() const -> std::size_t {
-        std::size_t size = 1;
-        if (first)
-            size += first->size();
-        if (second)
-            size += second->size();
-        return size;
+    auto contains(std::size_t offset) const -> bool {
+        return (data()[offset / 64] >> (offset % 64)) & 1;
     }
 
-    static auto match(std::vector<std::string_view> & candidates) -> bool {
-        if (candidates.empty())
-            return false;
-        for (const auto & candidate : candidates)
-            if (!candidate.empty())
+    auto operator |=(const offset_set & other) -> offset_set & {
+        auto * words = data();
+        const auto * other_words = other.data();
+        for (std::size_t i = 0; i < _word_number; ++i)
+            words[i] |= other_words[i];
+        return *this;
+    }
+
+    auto empty() const -> bool {
+        const auto * words = data();
+        for (std::size_t i = 0; i < _word_number; ++i)
+            if (words[i])
                 return false;
         return true;
     }
 
-    virtual auto evaluate(std::string_view str) const -> double {
-        context ctx;
-        auto candicates = parse(str, ctx);
-        if (match(candicates))
-            return 1.0 + 1.0 / ctx.compare_count;
-        double evaluation_value = static_cast<double>(ctx.match_count);
-        return evaluation_value;
+    auto count() const -> std::size_t {
+        const auto * words = data();
+        std::size_t n = 0;
+        for (std::size_t i = 0; i < _word_number; ++i)
+            n += count_bits(words[i]);
+        return n;
     }
 
-    virtual auto clone() const -> std::shared_ptr<grammer> = 0;
-
-    virtual auto print(std::ostream & out) const -> void {
-        out << "(" << name();
-        if (first || second)
-            out << " ";
-        if (first)
-            first->print(out);
-        if (first && second)
-            out << " ";
-        if (second)
-            second->print(out);
-        out << ")";
+    template<typename Function>
+    auto for_each(Function && f) const -> void {
+        const auto * words = data();
+        for (std::size_t i = 0; i < _word_number; ++i)
+            for (auto bits = words[i]; bits; bits &= bits - 1)
+                f(i * 64 + count_trailing_zeros(bits));
     }
 
-    virtual auto name() const -> const char * = 0;
+private:
+    auto data() -> std::uint64_t * {
+        return _heap.empty() ? _inline.data() : _heap.data();
+    }
 
-    virtual auto operand_number() const -> std::size_t = 0;
+    auto data() const -> const std::uint64_t * {
+        return _heap.empty() ? _inline.data() : _heap.data();
+    }
 
-    std::shared_ptr<grammer> first;
-    std::shared_ptr<grammer> second;
-    std::shared_ptr<void> impl_ptr;
+    std::size_t _word_number{};
+    std::array<std::uint64_t, inline_words> _inline{};
+    std::vector<std::uint64_t> _heap;
 };
 
-auto operator <<(std::ostream & out, const grammer & grm) -> std::ostream & {
-    grm.print(out);
-    return out;
-}
+// Vector of trivially copyable elements that keeps up to N of them inline and
+// moves to the heap only when it grows past that.
+template<typename T, std::size_t N>
+class small_vector {
+    static_assert(std::is_trivially_copyable<T>::value, "small_vector holds trivially copyable elements");
 
-class join : public grammer {
 public:
-    using grammer::grammer;
+    using value_type = T;
+    using iterator = T *;
+    using const_iterator = const T *;
 
-    virtual ~join() {}
+    small_vector() {}
 
-    virtual auto parse(std::string_view str, context & ctx) const -> std::vector<std::string_view> override {
-        ctx.compare_count += size();
-        std::vector<std::string_view> candidates;
-        if (first && second)
-            for (auto rest : first->parse(str, ctx))
-                for (auto s : second->parse(rest, ctx))
-                    candidates.push_back(s);
-        return candidates;
+    template<typename Iterator>
+    small_vector(Iterator first, Iterator last) {
+        reserve(static_cast<std::size_t>(std::distance(first, last)));
+        _size = static_cast<std::size_t>(std::copy(first, last, _data) - _data);
     }
 
-    virtual auto clone() const -> std::shared_ptr<grammer> override {
-        std::shared_ptr<grammer> first_clone, second_clone;
-        if (first)
-            first_clone = first->clone();
-        if (second)
-            second_clone = second->clone();
-        return std::make_shared<join>(first_clone, second_clone);
+    small_vector(const small_vector & other) {
+        *this = other;
     }
 
-    virtual auto name() const -> const char * override {
-        return "+";
+    small_vector(small_vector && other) noexcept {
+        *this = std::move(other);
     }
 
-    virtual auto operand_number() const -> std::size_t override {
-        return 2;
+    auto operator =(const small_vector & other) -> small_vector & {
+        if (this == &other)
+            return *this;
+        clear();
+        reserve(other._size);
+        std::copy(other.begin(), other.end(), _data);
+        _size = other._size;
+        return *this;
+    }
+
+    auto operator =(small_vector && other) noexcept -> small_vector & {
+        if (this == &other)
+            return *this;
+        if (other._heap) {
+            _heap = std::move(other._heap);
+            _data = _heap.get();
+            _capacity = other._capacity;
+        } else {
+            _heap.reset();
+            _data = _inline.data();
+            _capacity = N;
+            std::copy(other.begin(), other.end(), _data);
+        }
+        _size = other._size;
+        other._data = other._inline.data();
+        other._size = 0;
+        other._capacity = N;
+        return *this;
+    }
+
+    auto push_back(const T & value) -> void {
+        if (_size == _capacity)
+            reserve(_capacity * 2);
+        _data[_size++] = value;
+    }
+
+    // Keeps the capacity, so a list that has spilled stays on the heap.
+    auto clear() -> void {
+        _size = 0;
+    }
+
+    auto reserve(std::size_t capacity) -> void {
+        if (capacity <= _capacity)
+            return;
+        auto heap = std::make_unique<T[]>(capacity);
+        std::copy(begin(), end(), heap.get());
+        _heap = std::move(heap);
+        _data = _heap.get();
+        _capacity = capacity;
+    }
+
+    auto size() const -> std::size_t {
+        return _size;
+    }
+
+    auto capacity() const -> std::size_t {
+        return _capacity;
+    }
+
+    auto empty() const -> bool {
+        return _size == 0;
+    }
+
+    auto operator [](std::size_t index) -> T & {
+        return _data[index];
+    }
+
+    auto operator [](std::size_t index) const -> const T & {
+        return _data[index];
+    }
+
+    auto begin() -> iterator {
+        return _data;
+    }
+
+    auto end() -> iterator {
+        return _data + _size;
+    }
+
+    auto begin() const -> const_iterator {
+        return _data;
+    }
+
+    auto end() const -> const_iterator {
+        return _data + _size;
+    }
+
+    friend auto operator ==(const small_vector & a, const small_vector & b) -> bool {
+        return std::equal(a.begin(), a.end(), b.begin(), b.end());
+    }
+
+    friend auto operator !=(const small_vector & a, const small_vector & b) -> bool {
+        return !(a == b);
     }
-};
 
-class word : public grammer {
 private:
-    class impl_type {
+    std::array<T, N> _inline{};
+    std::unique_ptr<T[]> _heap;
+    T * _data{_inline.data()};
+    std::size_t _size{};
+    std::size_t _capacity{N};
+};
+
+#if defined(__cpp_impl_coroutine)
+// Minimal single-pass generator for C++20 coroutines. Values are produced on
+// demand, and destroying the generator destroys the suspended coroutine.
+template<typename T>
+class generator {
+public:
+    struct promise_type {
+        auto get_return_object() -> generator {
+            return generator{std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+
+        auto initial_suspend() noexcept -> std::suspend_always {
+            return {};
+        }
+
+        auto final_suspend() noexcept -> std::suspend_always {
+            return {};
+        }
+
+        auto yield_value(T yielded) noexcept -> std::suspend_always {
+            value = yielded;
+            return {};
+        }
+
+        auto return_void() noexcept -> void {}
+
+        auto unhandled_exception() -> void {
+            throw;
+        }
+
+        T value{};
+    };
+
+    class iterator {
     public:
-        impl_type(std::string_view view) : str{view} {}
-        std::string str;
+        explicit iterator(std::coroutine_handle<promise_type> handle) : _handle{handle} {}
+
+        auto operator ++() -> iterator & {
+            _handle.resume();
+            return *this;
+        }
+
+        auto operator *() const -> const T & {
+            return _handle.promise().value;
+        }
+
+        auto operator ==(std::default_sentinel_t) const -> bool {
+            return _handle.done();
+        }
+
+    private:
+        std::coroutine_handle<promise_type> _handle;
     };
 
-public:
-    word(std::string_view view) {
-        impl_ptr = std::make_shared<impl_type>(view);
+    explicit generator(std::coroutine_handle<promise_type> handle) : _handle{handle} {}
+
+    generator(generator && other) noexcept : _handle{std::exchange(other._handle, {})} {}
+
+    generator(const generator &) = delete;
+
+    auto operator =(const generator &) -> generator & = delete;
+
+    ~generator() {
+        if (_handle)
+            _handle.destroy();
     }
 
-    virtual ~word() {}
+    auto begin() -> iterator {
+        _handle.resume();
+        return iterator{_handle};
+    }
 
-    virtual auto parse(std::string_view str, context & ctx) const -> std::vector<std::string_view> override {
-        ctx.compare_count += size();
-        std::vector<std::string_view> candidates;
-        const auto & impl = *reinterpret_cast<impl_type*>(impl_ptr.get());
-        if (impl.str == std::string_view(str.data(), impl.str.size()))
-            candidates.emplace_back(str.data() + impl.str.size(), str.size() - impl.str.size());
-        ctx.match_count += candidates.size();
-        return candidates;
+    auto end() -> std::default_sentinel_t {
+        return {};
     }
 
-    virtual auto clone() const -> std::shared_ptr<grammer> override {
-        const auto & impl = *reinterpret_cast<impl_type*>(impl_ptr.get());
-        return std::make_shared<word>(impl.str);
+private:
+    std::coroutine_handle<promise_type> _handle;
+};
+#endif
+
+class grammer;
+
+class context {
+public:
+    // Most subtrees leave at most a few candidates, which then stay inline.
+    using candidate_list = small_vector<std::string_view, 4>;
+
+    // Identifies a node by its address, whichever representation it lives in.
+    using memo_key = std::pair<const void *, std::size_t>;
+
+    struct memo_key_hash {
+        auto operator ()(const memo_key & key) const -> std::size_t {
+            return std::hash<const void *>{}(key.first) ^ (key.second * 0x9e3779b97f4a7c15ull);
+        }
+    };
+
+    // Forget everything that refers to the previous input. The memo table
+    // keeps its buckets so that evaluating the next input does not reallocate.
+    auto reset() -> void {
+        match_count = 0;
+        compare_count = 0;
+        memo.clear();
+        offset_memo.clear();
+        candidates.clear();
     }
 
-    virtual auto print(std::ostream & out) const -> void override {
-        const auto & impl = *reinterpret_cast<impl_type*>(impl_ptr.get());
-        out << "\"" << impl.str << "\"";
+    auto push(candidate_list & out, std::string_view candidate) -> void {
+        if (out.size() == out.capacity())
+            ++allocation_count;
+        out.push_back(candidate);
     }
 
-    virtual auto name() const -> const char * override {
-        return "word";
+    // Scratch buffers are handed out in stack order, one per nesting level of
+    // parse, and keep their capacity across inputs. A deque keeps the
+    // buffers of outer levels in place while deeper levels are added.
+    auto acquire_scratch() -> candidate_list & {
+        if (scratch_depth == scratch.size()) {
+            scratch.emplace_back();
+            ++allocation_count;
+        }
+        auto & buffer = scratch[scratch_depth++];
+        buffer.clear();
+        return buffer;
     }
 
-    virtual auto operand_number() const -> std::size_t override {
-        return 0;
+    auto release_scratch() -> void {
+        --scratch_depth;
     }
+
+    std::size_t match_count{};
+    std::size_t compare_count{};
+
+    // Number of times evaluation had to grow a buffer or memo entry. It is
+    // never reset, so a warmed up context that evaluates without memoization
+    // must leave it unchanged.
+    std::size_t allocation_count{};
+
+    // Skip nodes whose minimum match length exceeds the remaining input and
+    // reject inputs outside the length bounds of the whole tree at once.
+    bool prune{};
+
+    // Let flat_tree parse subtrees that can yield at most one surviving
+    // candidate along a single path chosen by one byte of lookahead.
+    bool deterministic{};
+    candidate_list candidates;
+    std::deque<candidate_list> scratch;
+    std::size_t scratch_depth{};
+
+    // Walk stack of grammer::prefix_credit, kept empty between calls.
+    std::vector<const grammer *> credit_stack;
+
+    // Packrat memoization. Every remainder handed to parse is a suffix of the
+    // evaluated input, so its length identifies the start offset.
+    bool memoize{};
+    std::unordered_map<memo_key, candidate_list, memo_key_hash> memo;
+    std::unordered_map<memo_key, offset_set, memo_key_hash> offset_memo;
 };
 
-class or_ : public grammer {
+template<typename T>
+using evaluated = std::pair<T, double>;
+
+// Names a word literal in 32 bits. Literals of up to packed_size bytes are
+// stored in the id itself, so a word node keeps them inline; longer ones are
+// interned in literal_pool and the id holds their index. The last byte tells
+// the two apart: a packed id sets its high bit and keeps the length below it.
+class literal_id {
 public:
-    using grammer::grammer;
+    static constexpr std::size_t packed_size = 3;
 
-    virtual auto parse(std::string_view str, context & ctx) const -> std::vector<std::string_view> override {
-        ctx.compare_count += size();
-        std::vector<std::string_view> candidates;
-        if (first)
-            for (auto rest : first->parse(str, ctx))
-                candidates.push_back(rest);
-        if (second)
-            for (auto rest : second->parse(str, ctx))
-                candidates.push_back(rest);
-        return candidates;
+    literal_id() {}
+
+    static auto packed(std::string_view literal) -> literal_id {
+        literal_id id;
+        std::memcpy(id._bytes, literal.data(), literal.size());
+        id._bytes[3] = static_cast<char>(0x80 | literal.size());
+        return id;
     }
 
-    virtual auto clone() const -> std::shared_ptr<grammer> override {
-        std::shared_ptr<grammer> first_clone, second_clone;
-        if (first)
-            first_clone = first->clone();
-        if (second)
-            second_clone = second->clone();
-        return std::make_shared<or_>(first_clone, second_clone);
+    static auto pooled(std::uint32_t index) -> literal_id {
+        literal_id id;
+        for (std::size_t i = 0; i < 4; ++i)
+            id._bytes[i] = static_cast<char>(index >> (8 * i));
+        return id;
     }
 
-    virtual auto name() const -> const char * override {
-        return "|";
+    auto is_packed() const -> bool {
+        return static_cast<unsigned char>(_bytes[3]) & 0x80;
     }
 
-    virtual auto operand_number() const -> std::size_t override {
-        return 2;
+    // Views the literal of a packed id, which lives as long as the id.
+    auto packed_literal() const -> std::string_view {
+        return {_bytes, static_cast<std::size_t>(_bytes[3] & 0x7f)};
+    }
+
+    auto index() const -> std::uint32_t {
+        std::uint32_t index = 0;
+        for (std::size_t i = 0; i < 4; ++i)
+            index |= std::uint32_t{static_cast<unsigned char>(_bytes[i])} << (8 * i);
+        return index;
+    }
+
+    auto value() const -> std::uint32_t {
+        std::uint32_t v;
+        std::memcpy(&v, _bytes, 4);
+        return v;
+    }
+
+    auto operator ==(const literal_id & other) const -> bool {
+        return value() == other.value();
+    }
+
+    auto operator !=(const literal_id & other) const -> bool {
+        return value() != other.value();
     }
+
+private:
+    alignas(std::uint32_t) char _bytes[4]{};
 };
 
-class optional : public grammer {
+// Process-wide, append-only pool of the word literals too long to pack into
+// a literal_id. Each distinct one is stored once. Stored literals never
+// move, so the views returned for pooled ids stay valid for the lifetime of
+// the program.
+class literal_pool {
 public:
-    using grammer::grammer;
+    static auto instance() -> literal_pool & {
+        static literal_pool pool;
+        return pool;
+    }
 
-    virtual auto parse(std::string_view str, context & ctx) const -> std::vector<std::string_view> override {
-        ctx.compare_count += size();
-        std::vector<std::string_view> candidates;
-        if (first)
-            for (auto rest : first->parse(str, ctx))
-                candidates.push_back(rest);
-        candidates.push_back(str);
-        return candidates;
+    auto intern(std::string_view literal) -> literal_id {
+        if (literal.size() <= literal_id::packed_size)
+            return literal_id::packed(literal);
+        auto found = _ids.find(literal);
+        if (found != _ids.end())
+            return found->second;
+        if (_literals.size() >= std::size_t{1} << 31)
+            throw std::length_error("literal_pool is full.");
+        const auto id = literal_id::pooled(static_cast<std::uint32_t>(_literals.size()));
+        _literals.emplace_back(literal);
+        _ids.emplace(_literals.back(), id);
+        return id;
     }
 
-    virtual auto size() const -> std::size_t override {
-        std::size_t size = 1;
-        if (first)
-            size += first->size() * 2;
-        return size;
+    // The view of a packed id points into id, so it must outlive the view.
+    static auto get(const literal_id & id) -> std::string_view {
+        if (id.is_packed())
+            return id.packed_literal();
+        return instance()._literals[id.index()];
     }
 
-    virtual auto clone() const -> std::shared_ptr<grammer> override {
-        std::shared_ptr<grammer> first_clone, second_clone;
-        if (first)
-            first_clone = first->clone();
-        return std::make_shared<optional>(first_clone, std::shared_ptr<grammer>{});
+    // Number of pooled literals; packed ones are not counted.
+    auto size() const -> std::size_t {
+        return _literals.size();
+    }
+
+private:
+    std::deque<std::string> _literals;
+    std::unordered_map<std::string_view, literal_id> _ids;
+};
+
+// Bump allocator for the nodes of one generation. deallocate only counts,
+// and reset rewinds to the first block once nothing is live, so blocks are
+// reused across generations and a warmed-up arena never calls operator new.
+// The nodes themselves are still destroyed one by one by their shared_ptr
+// owners; only the rewind is O(1).
+class node_arena {
+public:
+    static constexpr std::size_t block_size = std::size_t{1} << 18;
+
+    struct statistics {
+        std::size_t allocation_count;
+        std::size_t byte_count;
+        std::size_t block_count;
+    };
+
+    // Makes make_node allocate from an arena until the scope ends; a null
+    // arena selects the heap.
+    class scope {
+    public:
+        explicit scope(node_arena * arena) : _previous{_current} {
+            _current = arena;
+        }
+
+        ~scope() {
+            _current = _previous;
+        }
+
+        scope(const scope &) = delete;
+
+        auto operator =(const scope &) -> scope & = delete;
+
+    private:
+        node_arena * _previous;
+    };
+
+    node_arena() {}
+
+    node_arena(const node_arena &) = delete;
+
+    auto operator =(const node_arena &) -> node_arena & = delete;
+
+    static auto current() -> node_arena * {
+        return _current;
+    }
+
+    auto allocate(std::size_t size, std::size_t alignment) -> void * {
+        while (true) {
+            if (_block < _blocks.size()) {
+                const auto offset = (_offset + alignment - 1) / alignment * alignment;
+                if (offset + size <= _blocks[_block].second) {
+                    _offset = offset + size;
+                    _live_count += 1;
+                    _statistics.allocation_count += 1;
+                    _statistics.byte_count += size;
+                    return _blocks[_block].first.get() + offset;
+                }
+                if (_block + 1 < _blocks.size()) {
+                    ++_block;
+                    _offset = 0;
+                    continue;
+                }
+            }
+            _blocks.emplace_back(std::make_unique<unsigned char[]>(std::max(block_size, size)), std::max(block_size, size));
+            _block = _blocks.size() - 1;
+            _offset = 0;
+            _statistics.block_count += 1;
+        }
+    }
+
+    auto deallocate(void *, std::size_t) noexcept -> void {
+        _live_count -= 1;
+    }
+
+    // Rewinds to the first block in O(1). Every allocation must have been
+    // deallocated already.
+    auto reset() -> void {
+        if (_live_count)
+            throw std::logic_error("node_arena has live allocations.");
+        _block = 0;
+        _offset = 0;
+        _statistics = {};
+    }
+
+    auto owns(const void * ptr) const -> bool {
+        const auto * p = static_cast<const unsigned char *>(ptr);
+        for (std::size_t i = 0; i < _blocks.size() && i <= _block; ++i) {
+            const auto * begin = _blocks[i].first.get();
+            if (begin <= p && p < begin + _blocks[i].second)
+                return true;
+        }
+        return false;
+    }
+
+    auto live_count() const -> std::size_t {
+        return _live_count;
+    }
+
+    // Allocations since the last reset.
+    auto stats() const -> const statistics & {
+        return _statistics;
+    }
+
+private:
+    static inline node_arena * _current = nullptr;
+
+    std::vector<std::pair<std::unique_ptr<unsigned char[]>, std::size_t>> _blocks;
+    std::size_t _block{};
+    std::size_t _offset{};
+    std::size_t _live_count{};
+    statistics _statistics{};
+};
+
+template<typename T>
+class arena_allocator {
+public:
+    using value_type = T;
+
+    explicit arena_allocator(node_arena & arena) noexcept : _arena{&arena} {}
+
+    template<typename U>
+    arena_allocator(const arena_allocator<U> & other) noexcept : _arena{other.arena()} {}
+
+    auto allocate(std::size_t n) -> T * {
+        return static_cast<T *>(_arena->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    auto deallocate(T * ptr, std::size_t n) noexcept -> void {
+        _arena->deallocate(ptr, n * sizeof(T));
+    }
+
+    auto arena() const noexcept -> node_arena * {
+        return _arena;
+    }
+
+    template<typename U>
+    auto operator ==(const arena_allocator<U> & other) const noexcept -> bool {
+        return _arena == other.arena();
+    }
+
+    template<typename U>
+    auto operator !=(const arena_allocator<U> & other) const noexcept -> bool {
+        return _arena != other.arena();
+    }
+
+private:
+    node_arena * _arena;
+};
+
+// Creates a node in the current node_arena, or on the heap outside any scope.
+template<typename Node, typename... Args>
+auto make_node(Args &&... args) -> std::shared_ptr<Node> {
+    if (auto * arena = node_arena::current())
+        return std::allocate_shared<Node>(arena_allocator<Node>{*arena}, std::forward<Args>(args)...);
+    return std::make_shared<Node>(std::forward<Args>(args)...);
+}
+
+class grammer : public std::enable_shared_from_this<grammer> {
+public:
+    grammer() {}
+
+    grammer(
+        const std::shared_ptr<grammer> & first,
+        const std::shared_ptr<grammer> & second
+    )
+        : first{first}
+        , second{second}
+    {}
+
+    // Operands owned by this node alone are taken apart one node at a time,
+    // so destroying a deep tree neither recurses through shared_ptr nor
+    // allocates.
+    virtual ~grammer() {
+        destroy(release(first));
+        destroy(release(second));
+    }
+
+    auto parse(std::string_view str, context & ctx) const -> context::candidate_list {
+        context::candidate_list candidates;
+        parse(str, ctx, candidates);
+        return candidates;
+    }
+
+    // Appends the candidates to out instead of returning a fresh vector.
+    auto parse(std::string_view str, context & ctx, context::candidate_list & out) const -> void {
+        if (ctx.prune && str.size() < min_length()) {
+            ctx.match_count += prefix_credit(str, ctx);
+            return;
+        }
+        if (!ctx.memoize) {
+            do_parse(str, ctx, out);
+            return;
+        }
+        const context::memo_key key{this, str.size()};
+        auto found = ctx.memo.find(key);
+        if (found != ctx.memo.end()) {
+            for (auto candidate : found->second)
+                ctx.push(out, candidate);
+            return;
+        }
+        const auto begin = out.size();
+        do_parse(str, ctx, out);
+        ctx.memo.emplace(key, context::candidate_list(out.begin() + begin, out.end()));
+        ++ctx.allocation_count;
+    }
+
+    // Returns the distinct offsets into input at which a match starting at
+    // offset can end.
+    auto parse_offsets(std::string_view input, std::size_t offset, context & ctx) const -> offset_set {
+        if (ctx.prune && input.size() - offset < min_length()) {
+            ctx.match_count += prefix_credit(input.substr(offset), ctx);
+            return offset_set{input.size()};
+        }
+        if (!ctx.memoize)
+            return do_parse_offsets(input, offset, ctx);
+        const context::memo_key key{this, offset};
+        auto found = ctx.offset_memo.find(key);
+        if (found != ctx.offset_memo.end())
+            return found->second;
+        auto offsets = do_parse_offsets(input, offset, ctx);
+        ctx.offset_memo.emplace(key, offsets);
+        return offsets;
+    }
+
+    // Attributes of the subtree are cached on first use. Code that rearranges
+    // the children of a node must invalidate its cache, or call update_cache
+    // on the root afterwards.
+    auto size() const -> std::size_t {
+        if (!_size)
+            cache_attributes();
+        return _size;
+    }
+
+    // Number of nodes in the subtree, counting every non-null operand like
+    // get_nodes. Unlike size, an optional does not weigh its operand twice.
+    auto node_count() const -> std::size_t {
+        if (!_size)
+            cache_attributes();
+        return _node_count;
+    }
+
+    // Bounds on the length of the strings the subtree matches. A subtree that
+    // can never match has a min_length greater than its max_length.
+    auto min_length() const -> std::size_t {
+        cache_lengths();
+        return _min_length;
+    }
+
+    auto max_length() const -> std::size_t {
+        cache_lengths();
+        return _max_length;
+    }
+
+    auto matchable() const -> bool {
+        return min_length() <= max_length();
+    }
+
+    // Partial credit for a remainder that pruning skips this subtree for:
+    // the number of its words that match at the start of str. It stands in
+    // for the match_count that parsing the subtree would have added, so
+    // pruning does not erase the fitness of inputs it rejects.
+    auto prefix_credit(std::string_view str, context & ctx) const -> std::size_t {
+        std::size_t credit = 0;
+        auto & stack = ctx.credit_stack;
+        const auto capacity = stack.capacity();
+        stack.push_back(this);
+        while (!stack.empty()) {
+            const auto * node = stack.back();
+            stack.pop_back();
+            credit += node->matches_prefix(str);
+            const grammer * operands[] = {node->first.get(), node->second.get()};
+            for (std::size_t i = 0; i < node->operand_number(); ++i)
+                if (operands[i])
+                    stack.push_back(operands[i]);
+        }
+        if (stack.capacity() != capacity)
+            ++ctx.allocation_count;
+        return credit;
+    }
+
+    // Structural hash of the subtree. Operands a node does not use, such as
+    // the children of a word, are ignored.
+    auto hash() const -> std::uint64_t {
+        if (!_size)
+            cache_attributes();
+        return _hash;
+    }
+
+    // Structural equality under the same rules as hash(). Hashes are
+    // compared first, so different trees are usually told apart at once.
+    auto equals(const grammer & other) const -> bool {
+        std::vector<std::pair<const grammer *, const grammer *>> stack{{this, &other}};
+        while (!stack.empty()) {
+            const auto [a, b] = stack.back();
+            stack.pop_back();
+            if (a == b)
+                continue;
+            if (!a || !b || a->hash() != b->hash() || !a->same_node(*b))
+                return false;
+            if (a->operand_number() > 0)
+                stack.emplace_back(a->first.get(), b->first.get());
+            if (a->operand_number() > 1)
+                stack.emplace_back(a->second.get(), b->second.get());
+        }
+        return true;
+    }
+
+    auto invalidate_cache() const -> void {
+        _size = 0;
+        _lengths_cached = false;
+    }
+
+    auto update_cache() const -> std::size_t {
+        std::vector<const grammer *> stack{this};
+        while (!stack.empty()) {
+            const auto * node = stack.back();
+            stack.pop_back();
+            node->invalidate_cache();
+            for (const auto * operand : {node->first.get(), node->second.get()})
+                if (operand)
+                    stack.push_back(operand);
+        }
+        cache_attributes();
+        return size();
+    }
+
+    static auto match(const context::candidate_list & candidates) -> bool {
+        if (candidates.empty())
+            return false;
+        for (const auto & candidate : candidates)
+            if (!candidate.empty())
+                return false;
+        return true;
+    }
+
+    auto evaluate(std::string_view str) const -> double {
+        context ctx;
+        return evaluate(str, ctx);
+    }
+
+    static auto match(const offset_set & offsets, std::size_t input_size) -> bool {
+        return offsets.count() == 1 && offsets.contains(input_size);
+    }
+
+    static auto score(bool matched, const context & ctx) -> double {
+        return score(matched, ctx.match_count, ctx.compare_count);
+    }
+
+    static auto score(bool matched, std::size_t match_count, std::size_t compare_count) -> double {
+        if (matched)
+            return 1.0 + 1.0 / compare_count;
+        double evaluation_value = static_cast<double>(match_count);
+        return evaluation_value;
+    }
+
+    virtual auto evaluate(std::string_view str, context & ctx) const -> double {
+        ctx.reset();
+        if (ctx.prune && (str.size() < min_length() || str.size() > max_length())) {
+            ctx.match_count += prefix_credit(str, ctx);
+            return score(false, ctx);
+        }
+        parse(str, ctx, ctx.candidates);
+        return score(match(ctx.candidates), ctx);
+    }
+
+    auto evaluate_offsets(std::string_view str, context & ctx) const -> double {
+        ctx.reset();
+        if (ctx.prune && (str.size() < min_length() || str.size() > max_length())) {
+            ctx.match_count += prefix_credit(str, ctx);
+            return score(false, ctx);
+        }
+        auto offsets = parse_offsets(str, 0, ctx);
+        return score(match(offsets, str.size()), ctx);
+    }
+
+    // Deep copy of the operands the node uses; unused operand slots are left
+    // empty in the copy.
+    auto clone() const -> std::shared_ptr<grammer> {
+        // Copies keep their cached attributes; a dropped operand invalidates
+        // its node and every node above it.
+        std::vector<std::pair<grammer *, std::size_t>> nodes{{nullptr, 0}};
+        auto root = copy();
+        nodes[0].first = root.get();
+        std::vector<std::size_t> stack{0};
+        while (!stack.empty()) {
+            const auto index = stack.back();
+            stack.pop_back();
+            auto * node = nodes[index].first;
+            const auto operand_count = node->operand_number();
+            std::size_t i = 0;
+            for (auto * operand : {&node->first, &node->second}) {
+                const bool used = i++ < operand_count;
+                if (!*operand)
+                    continue;
+                if (used) {
+                    *operand = (*operand)->copy();
+                    stack.push_back(nodes.size());
+                    nodes.emplace_back(operand->get(), index);
+                    if ((*operand)->_size)
+                        continue;
+                } else {
+                    operand->reset();
+                }
+                for (auto k = index; ; k = nodes[k].second) {
+                    nodes[k].first->invalidate_cache();
+                    if (k == 0)
+                        break;
+                }
+            }
+        }
+        return root;
+    }
+
+    // Copies this node alone. A copy that shares the operands of the
+    // original keeps its cached attributes.
+    auto copy() const -> std::shared_ptr<grammer> {
+        auto node = do_copy();
+        if (node->first != first || node->second != second)
+            return node;
+        node->_size = _size;
+        node->_node_count = _node_count;
+        node->_min_length = _min_length;
+        node->_max_length = _max_length;
+        node->_lengths_cached = _lengths_cached;
+        node->_hash = _hash;
+        return node;
+    }
+
+    virtual auto print(std::ostream & out) const -> void {
+        // Each entry is either a node to print or text that closes one.
+        std::vector<std::pair<const grammer *, const char *>> stack{{this, nullptr}};
+        while (!stack.empty()) {
+            const auto [node, text] = stack.back();
+            stack.pop_back();
+            if (!node) {
+                out << text;
+                continue;
+            }
+            if (node->print_leaf(out))
+                continue;
+            out << "(" << node->name();
+            if (node->first || node->second)
+                out << " ";
+            stack.emplace_back(nullptr, ")");
+            if (node->second)
+                stack.emplace_back(node->second.get(), nullptr);
+            if (node->first && node->second)
+                stack.emplace_back(nullptr, " ");
+            if (node->first)
+                stack.emplace_back(node->first.get(), nullptr);
+        }
+    }
+
+    virtual auto name() const -> const char * = 0;
+
+    virtual auto operand_number() const -> std::size_t = 0;
+
+    std::shared_ptr<grammer> first;
+    std::shared_ptr<grammer> second;
+
+protected:
+    static auto unmatchable_lengths() -> std::pair<std::size_t, std::size_t> {
+        return {std::numeric_limits<std::size_t>::max(), 0};
+    }
+
+    virtual auto calculate_lengths() const -> std::pair<std::size_t, std::size_t> = 0;
+
+    // True if this node is a word whose literal begins str.
+    virtual auto matches_prefix(std::string_view) const -> bool {
+        return false;
+    }
+
+    // Prints a node that has no parenthesized form and returns true, or
+    // returns false to print it as an operation.
+    virtual auto print_leaf(std::ostream &) const -> bool {
+        return false;
+    }
+
+    virtual auto calculate_size() const -> std::size_t {
+        std::size_t size = 1;
+        if (first)
+            size += first->size();
+        if (second)
+            size += second->size();
+        return size;
+    }
+
+    // Called with the operands' hashes already cached. Operands past
+    // operand_number are ignored, and a missing operand hashes differently
+    // from every subtree.
+    virtual auto calculate_hash() const -> std::uint64_t {
+        auto h = hash_bytes(name());
+        const grammer * operands[] = {first.get(), second.get()};
+        for (std::size_t i = 0; i < operand_number(); ++i)
+            h = hash_combine(h, operands[i] ? operands[i]->_hash : 0);
+        return h;
+    }
+
+    // Compares this node with other, ignoring the operands.
+    virtual auto same_node(const grammer & other) const -> bool {
+        return std::strcmp(name(), other.name()) == 0;
+    }
+
+    virtual auto do_copy() const -> std::shared_ptr<grammer> = 0;
+
+    virtual auto do_parse(std::string_view str, context & ctx, context::candidate_list & out) const -> void = 0;
+
+    virtual auto do_parse_offsets(std::string_view input, std::size_t offset, context & ctx) const -> offset_set = 0;
+
+private:
+    // Returns the operand if this slot was its only owner, and empties the
+    // slot either way.
+    static auto release(std::shared_ptr<grammer> & operand) -> std::shared_ptr<grammer> {
+        if (operand && operand.use_count() == 1)
+            return std::move(operand);
+        operand.reset();
+        return nullptr;
+    }
+
+    // Rotates each owned first operand above its parent until the top node
+    // has none, then destroys that node, whose destructor has nothing left
+    // to release, and continues with its second operand.
+    static auto destroy(std::shared_ptr<grammer> node) -> void {
+        while (node) {
+            if (auto left = release(node->first)) {
+                node->first = std::move(left->second);
+                left->second = std::move(node);
+                node = std::move(left);
+                continue;
+            }
+            auto next = release(node->second);
+            node = std::move(next);
+        }
+    }
+
+    auto cache_lengths() const -> void {
+        if (!_lengths_cached)
+            cache_attributes();
+    }
+
+    auto cached() const -> bool {
+        return _size && _lengths_cached;
+    }
+
+    // Fills the caches of the subtree bottom-up with an explicit stack, so
+    // calculate_size and calculate_lengths only read operands that are
+    // already cached and never recurse.
+    auto cache_attributes() const -> void {
+        if (cached())
+            return;
+        std::vector<std::pair<const grammer *, bool>> stack{{this, false}};
+        while (!stack.empty()) {
+            const auto [node, expanded] = stack.back();
+            if (expanded) {
+                stack.pop_back();
+                if (!node->_size) {
+                    node->_size = node->calculate_size();
+                    node->_node_count = 1;
+                    for (const auto * operand : {node->first.get(), node->second.get()})
+                        if (operand)
+                            node->_node_count += operand->_node_count;
+                    node->_hash = node->calculate_hash();
+                }
+                if (!node->_lengths_cached) {
+                    std::tie(node->_min_length, node->_max_length) = node->calculate_lengths();
+                    node->_lengths_cached = true;
+                }
+                continue;
+            }
+            stack.back().second = true;
+            for (const auto * operand : {node->first.get(), node->second.get()})
+                if (operand && !operand->cached())
+                    stack.emplace_back(operand, false);
+        }
+    }
+
+    mutable std::size_t _size{};
+    mutable std::size_t _node_count{};
+    mutable std::size_t _min_length{};
+    mutable std::size_t _max_length{};
+    mutable bool _lengths_cached{};
+    mutable std::uint64_t _hash{};
+};
+
+auto operator <<(std::ostream & out, const grammer & grm) -> std::ostream & {
+    grm.print(out);
+    return out;
+}
+
+class join : public grammer {
+public:
+    using grammer::grammer;
+
+    virtual ~join() {}
+
+    virtual auto do_parse(std::string_view str, context & ctx, context::candidate_list & out) const -> void override {
+        ctx.compare_count += size();
+        if (!(first && second))
+            return;
+        auto & rests = ctx.acquire_scratch();
+        first->parse(str, ctx, rests);
+        for (auto rest : rests)
+            second->parse(rest, ctx, out);
+        ctx.release_scratch();
+    }
+
+    virtual auto do_parse_offsets(std::string_view input, std::size_t offset, context & ctx) const -> offset_set override {
+        ctx.compare_count += size();
+        offset_set offsets{input.size()};
+        if (first && second)
+            first->parse_offsets(input, offset, ctx).for_each([&](std::size_t rest){
+                offsets |= second->parse_offsets(input, rest, ctx);
+            });
+        return offsets;
+    }
+
+    virtual auto do_copy() const -> std::shared_ptr<grammer> override {
+        return make_node<join>(first, second);
+    }
+
+    virtual auto calculate_lengths() const -> std::pair<std::size_t, std::size_t> override {
+        if (!(first && second && first->matchable() && second->matchable()))
+            return unmatchable_lengths();
+        return {first->min_length() + second->min_length(), first->max_length() + second->max_length()};
+    }
+
+    virtual auto name() const -> const char * override {
+        return "+";
+    }
+
+    virtual auto operand_number() const -> std::size_t override {
+        return 2;
+    }
+};
+
+class word : public grammer {
+public:
+    word(std::string_view view) : word{literal_pool::instance().intern(view)} {}
+
+    explicit word(literal_id id) : _literal_id{id} {}
+
+    virtual ~word() {}
+
+    virtual auto do_parse(std::string_view str, context & ctx, context::candidate_list & out) const -> void override {
+        ctx.compare_count += size();
+        const auto lit = literal();
+        if (starts_with_literal(str, lit)) {
+            ctx.push(out, std::string_view(str.data() + lit.size(), str.size() - lit.size()));
+            ctx.match_count += 1;
+        }
+    }
+
+    virtual auto do_parse_offsets(std::string_view input, std::size_t offset, context & ctx) const -> offset_set override {
+        ctx.compare_count += size();
+        offset_set offsets{input.size()};
+        const auto lit = literal();
+        if (starts_with_literal(input.substr(offset), lit)) {
+            offsets.insert(offset + lit.size());
+            ctx.match_count += 1;
+        }
+        return offsets;
+    }
+
+    virtual auto do_copy() const -> std::shared_ptr<grammer> override {
+        return make_node<word>(_literal_id);
+    }
+
+    auto literal() const -> std::string_view {
+        return literal_pool::get(_literal_id);
+    }
+
+    auto id() const -> literal_id {
+        return _literal_id;
+    }
+
+    virtual auto calculate_lengths() const -> std::pair<std::size_t, std::size_t> override {
+        const auto lit = literal();
+        return {lit.size(), lit.size()};
+    }
+
+    virtual auto name() const -> const char * override {
+        return "word";
+    }
+
+    virtual auto print_leaf(std::ostream & out) const -> bool override {
+        out << "\"" << literal() << "\"";
+        return true;
+    }
+
+    virtual auto matches_prefix(std::string_view str) const -> bool override {
+        return starts_with_literal(str, literal());
+    }
+
+    virtual auto calculate_hash() const -> std::uint64_t override {
+        return hash_combine(hash_bytes(name()), hash_bytes(literal()));
+    }
+
+    virtual auto same_node(const grammer & other) const -> bool override {
+        return grammer::same_node(other) && static_cast<const word &>(other)._literal_id == _literal_id;
+    }
+
+    virtual auto operand_number() const -> std::size_t override {
+        return 0;
+    }
+
+private:
+    literal_id _literal_id;
+};
+
+class or_ : public grammer {
+public:
+    using grammer::grammer;
+
+    virtual auto do_parse(std::string_view str, context & ctx, context::candidate_list & out) const -> void override {
+        ctx.compare_count += size();
+        if (first)
+            first->parse(str, ctx, out);
+        if (second)
+            second->parse(str, ctx, out);
+    }
+
+    virtual auto do_parse_offsets(std::string_view input, std::size_t offset, context & ctx) const -> offset_set override {
+        ctx.compare_count += size();
+        offset_set offsets{input.size()};
+        if (first)
+            offsets |= first->parse_offsets(input, offset, ctx);
+        if (second)
+            offsets |= second->parse_offsets(input, offset, ctx);
+        return offsets;
+    }
+
+    virtual auto do_copy() const -> std::shared_ptr<grammer> override {
+        return make_node<or_>(first, second);
+    }
+
+    virtual auto calculate_lengths() const -> std::pair<std::size_t, std::size_t> override {
+        auto lengths = unmatchable_lengths();
+        for (const auto & operand : {first, second}) {
+            if (!operand || !operand->matchable())
+                continue;
+            lengths.first = std::min(lengths.first, operand->min_length());
+            lengths.second = std::max(lengths.second, operand->max_length());
+        }
+        return lengths;
+    }
+
+    virtual auto name() const -> const char * override {
+        return "|";
+    }
+
+    virtual auto operand_number() const -> std::size_t override {
+        return 2;
+    }
+};
+
+class optional : public grammer {
+public:
+    using grammer::grammer;
+
+    virtual auto do_parse(std::string_view str, context & ctx, context::candidate_list & out) const -> void override {
+        ctx.compare_count += size();
+        if (first)
+            first->parse(str, ctx, out);
+        ctx.push(out, str);
+    }
+
+    virtual auto do_parse_offsets(std::string_view input, std::size_t offset, context & ctx) const -> offset_set override {
+        ctx.compare_count += size();
+        offset_set offsets{input.size()};
+        if (first)
+            offsets |= first->parse_offsets(input, offset, ctx);
+        offsets.insert(offset);
+        return offsets;
+    }
+
+    virtual auto calculate_size() const -> std::size_t override {
+        std::size_t size = 1;
+        if (first)
+            size += first->size() * 2;
+        return size;
+    }
+
+    virtual auto do_copy() const -> std::shared_ptr<grammer> override {
+        return make_node<optional>(first, second);
+    }
+
+    virtual auto calculate_lengths() const -> std::pair<std::size_t, std::size_t> override {
+        if (!first || !first->matchable())
+            return {0, 0};
+        return {0, first->max_length()};
+    }
+
+    virtual auto name() const -> const char * override {
+        return "?";
+    }
+
+    virtual auto operand_number() const -> std::size_t override {
+        return 1;
+    }
+};
+
+// How an input that does not match is scored. match_count is the original
+// by-product of enumerating candidates. The other two are computed by one
+// left to right pass over the automaton and are divided by the input size
+// plus one, so any full match outscores every partial one.
+//   longest_prefix: the longest prefix after which the automaton still holds
+//   a position from which a match can be completed, i.e. the longest prefix
+//   that can still be extended to a match.
+//   reachable_positions: offsets of the input at which a match of the
+//   grammer starting at the beginning of the input ends.
+enum class fitness_function {
+    match_count,
+    longest_prefix,
+    reachable_positions
+};
+
+// Position automaton of a grammer tree. Every byte of every word is one
+// position, so the automaton has no epsilon transitions and its state is a
+// plain bitset of positions that have just matched.
+class glushkov_nfa {
+public:
+    // Follow sets of groups of eight positions are precombined into tables
+    // while the automaton is small enough for them to stay cheap to build.
+    static constexpr std::size_t max_table_position_number = 128;
+
+    glushkov_nfa() {}
+
+    explicit glushkov_nfa(const grammer & root) {
+        std::vector<std::pair<const word *, std::size_t>> words;
+        collect_words(root, words);
+        _position_number = 0;
+        for (auto & w : words) {
+            w.second = _position_number;
+            _position_number += w.first->literal().size();
+        }
+        _word_number = std::max<std::size_t>(1, (_position_number + 63) / 64);
+        _follow.assign(_position_number * _word_number, 0);
+        _labels.assign(256 * _word_number, 0);
+        _word_ends.assign(_word_number, 0);
+        _labels_of_positions.resize(_position_number);
+
+        std::unordered_map<const word *, std::size_t> offsets(words.begin(), words.end());
+        auto frag = compile(root, offsets);
+        _first = std::move(frag.first);
+        _last = std::move(frag.last);
+        _first.resize(_word_number);
+        _last.resize(_word_number);
+        _nullable = frag.nullable;
+        mark_viable();
+
+        if (_position_number <= max_table_position_number)
+            build_tables();
+    }
+
+    auto position_number() const -> std::size_t {
+        return _position_number;
+    }
+
+    auto word_number() const -> std::size_t {
+        return _word_number;
+    }
+
+    auto nullable() const -> bool {
+        return _nullable;
+    }
+
+    auto first() const -> const std::uint64_t * {
+        return _first.data();
+    }
+
+    auto last() const -> const std::uint64_t * {
+        return _last.data();
+    }
+
+    auto word_ends() const -> const std::uint64_t * {
+        return _word_ends.data();
+    }
+
+    auto follow(std::size_t position) const -> const std::uint64_t * {
+        return _follow.data() + position * _word_number;
+    }
+
+    auto labels(unsigned char c) const -> const std::uint64_t * {
+        return _labels.data() + c * _word_number;
+    }
+
+    auto label(std::size_t position) const -> unsigned char {
+        return _labels_of_positions[position];
+    }
+
+    // Writes into next the positions that can match c after the positions
+    // in state. A null state stands for the start of the input.
+    auto step(const std::uint64_t * state, unsigned char c, std::uint64_t * next) const -> void {
+        const auto * label_bits = labels(c);
+        if (!state) {
+            for (std::size_t i = 0; i < _word_number; ++i)
+                next[i] = _first[i] & label_bits[i];
+            return;
+        }
+        std::fill(next, next + _word_number, std::uint64_t{0});
+        if (!_tables.empty()) {
+            for (std::size_t k = 0; k * 8 < _position_number; ++k) {
+                const auto byte = (state[k / 8] >> (k % 8 * 8)) & 0xff;
+                if (!byte)
+                    continue;
+                const auto * row = _tables.data() + (k * 256 + byte) * _word_number;
+                for (std::size_t i = 0; i < _word_number; ++i)
+                    next[i] |= row[i];
+            }
+        } else {
+            for (std::size_t i = 0; i < _word_number; ++i)
+                for (auto bits = state[i]; bits; bits &= bits - 1) {
+                    const auto * row = follow(i * 64 + count_trailing_zeros(bits));
+                    for (std::size_t j = 0; j < _word_number; ++j)
+                        next[j] |= row[j];
+                }
+        }
+        for (std::size_t i = 0; i < _word_number; ++i)
+            next[i] &= label_bits[i];
+    }
+
+    auto accepts(const std::uint64_t * state) const -> bool {
+        if (!state)
+            return _nullable;
+        for (std::size_t i = 0; i < _word_number; ++i)
+            if (state[i] & _last[i])
+                return true;
+        return false;
+    }
+
+    // Runs the automaton over str with the same notion of a match as
+    // grammer::match: the input matches when the only prefix of it in the
+    // language is the input itself. match_count counts the distinct
+    // (word, end offset) pairs reached and compare_count the positions visited.
+    auto recognize(std::string_view str, context & ctx) const -> bool {
+        return scan(str, ctx).matched;
+    }
+
+    struct scan_result {
+        bool matched;
+        std::size_t prefix_length;
+        std::size_t end_offset_number;
+    };
+
+    // recognize, also reporting the measures of fitness_function.
+    auto scan(std::string_view str, context & ctx) const -> scan_result {
+        ctx.compare_count += 1;
+        scan_result result{false, 0, _nullable ? std::size_t{1} : std::size_t{0}};
+        bool accepted_early = !str.empty() && _nullable;
+        bool accepted = str.empty() && _nullable;
+        std::vector<std::uint64_t> buffer(_word_number * 2);
+        std::uint64_t * state = nullptr;
+        std::uint64_t * next = buffer.data();
+        for (std::size_t i = 0; i < str.size(); ++i) {
+            step(state, static_cast<unsigned char>(str[i]), next);
+            state = next;
+            next = (state == buffer.data()) ? buffer.data() + _word_number : buffer.data();
+            bool alive = false;
+            bool viable = false;
+            for (std::size_t j = 0; j < _word_number; ++j) {
+                ctx.compare_count += count_bits(state[j]);
+                ctx.match_count += count_bits(state[j] & _word_ends[j]);
+                alive = alive || state[j];
+                viable = viable || (state[j] & _viable[j]);
+            }
+            if (!alive)
+                break;
+            if (viable)
+                result.prefix_length = i + 1;
+            if (accepts(state)) {
+                result.end_offset_number += 1;
+                if (i + 1 == str.size())
+                    accepted = true;
+                else
+                    accepted_early = true;
+            }
+        }
+        result.matched = accepted && !accepted_early;
+        return result;
+    }
+
+    auto evaluate(std::string_view str, context & ctx, fitness_function fitness = fitness_function::match_count) const -> double {
+        ctx.reset();
+        const auto result = scan(str, ctx);
+        if (result.matched || fitness == fitness_function::match_count)
+            return grammer::score(result.matched, ctx);
+        const auto measure = fitness == fitness_function::longest_prefix ? result.prefix_length : result.end_offset_number;
+        return static_cast<double>(measure) / static_cast<double>(str.size() + 1);
+    }
+
+private:
+    struct fragment {
+        std::vector<std::uint64_t> first;
+        std::vector<std::uint64_t> last;
+        bool nullable{};
+    };
+
+    // Mirrors the operands that parse visits: join needs both of them, or_
+    // either of them, and a missing operand of optional is the empty string.
+    // Words are collected in prefix order.
+    static auto collect_words(
+        const grammer & root,
+        std::vector<std::pair<const word *, std::size_t>> & words
+    ) -> void {
+        std::vector<const grammer *> stack{&root};
+        while (!stack.empty()) {
+            const auto * node = stack.back();
+            stack.pop_back();
+            if (auto w = dynamic_cast<const word *>(node)) {
+                words.emplace_back(w, 0);
+                continue;
+            }
+            if (dynamic_cast<const join *>(node) && !(node->first && node->second))
+                continue;
+            if (node->second && node->operand_number() == 2)
+                stack.push_back(node->second.get());
+            if (node->first)
+                stack.push_back(node->first.get());
+        }
+    }
+
+    auto set_bit(std::vector<std::uint64_t> & bits, std::size_t position) const -> void {
+        bits.resize(_word_number);
+        bits[position / 64] |= std::uint64_t{1} << (position % 64);
+    }
+
+    auto unite(std::vector<std::uint64_t> & bits, const std::vector<std::uint64_t> & other) const -> void {
+        bits.resize(_word_number);
+        for (std::size_t i = 0; i < other.size(); ++i)
+            bits[i] |= other[i];
+    }
+
+    auto connect(const std::vector<std::uint64_t> & from, const std::vector<std::uint64_t> & to) -> void {
+        for (std::size_t i = 0; i < from.size(); ++i)
+            for (auto bits = from[i]; bits; bits &= bits - 1) {
+                auto * row = _follow.data() + (i * 64 + count_trailing_zeros(bits)) * _word_number;
+                for (std::size_t j = 0; j < to.size(); ++j)
+                    row[j] |= to[j];
+            }
+    }
+
+    // Builds the fragment of the subtree bottom-up. Each node is visited
+    // again after its operands, whose fragments are then on top of results.
+    auto compile(
+        const grammer & root,
+        const std::unordered_map<const word *, std::size_t> & offsets
+    ) -> fragment {
+        std::vector<std::pair<const grammer *, bool>> stack{{&root, false}};
+        std::vector<fragment> results;
+        while (!stack.empty()) {
+            const auto [node, expanded] = stack.back();
+            stack.pop_back();
+            if (auto w = dynamic_cast<const word *>(node)) {
+                results.push_back(compile_word(*w, offsets.at(w)));
+                continue;
+            }
+            const bool is_join = dynamic_cast<const join *>(node) != nullptr;
+            const bool is_or = dynamic_cast<const or_ *>(node) != nullptr;
+            if (!expanded) {
+                stack.emplace_back(node, true);
+                if (is_join && !(node->first && node->second))
+                    continue;
+                if ((is_join || is_or) && node->second)
+                    stack.emplace_back(node->second.get(), false);
+                if (node->first)
+                    stack.emplace_back(node->first.get(), false);
+                continue;
+            }
+            fragment frag;
+            if (is_join) {
+                if (node->first && node->second) {
+                    auto b = std::move(results.back());
+                    results.pop_back();
+                    auto a = std::move(results.back());
+                    results.pop_back();
+                    connect(a.last, b.first);
+                    frag.first = std::move(a.first);
+                    if (a.nullable)
+                        unite(frag.first, b.first);
+                    frag.last = std::move(b.last);
+                    if (b.nullable)
+                        unite(frag.last, a.last);
+                    frag.nullable = a.nullable && b.nullable;
+                }
+            } else if (is_or) {
+                for (const auto * operand : {node->first.get(), node->second.get()}) {
+                    if (!operand)
+                        continue;
+                    auto a = std::move(results.back());
+                    results.pop_back();
+                    unite(frag.first, a.first);
+                    unite(frag.last, a.last);
+                    frag.nullable = frag.nullable || a.nullable;
+                }
+            } else {
+                frag.nullable = true;
+                if (node->first) {
+                    auto a = std::move(results.back());
+                    results.pop_back();
+                    frag.first = std::move(a.first);
+                    frag.last = std::move(a.last);
+                }
+            }
+            results.push_back(std::move(frag));
+        }
+        return std::move(results.back());
+    }
+
+    auto compile_word(const word & w, std::size_t begin) -> fragment {
+        fragment frag;
+        const auto str = w.literal();
+        if (str.empty()) {
+            frag.nullable = true;
+            return frag;
+        }
+        for (std::size_t i = 0; i < str.size(); ++i) {
+            const auto position = begin + i;
+            _labels_of_positions[position] = static_cast<unsigned char>(str[i]);
+            _labels[static_cast<unsigned char>(str[i]) * _word_number + position / 64] |= std::uint64_t{1} << (position % 64);
+            if (i + 1 < str.size())
+                _follow[position * _word_number + (position + 1) / 64] |= std::uint64_t{1} << ((position + 1) % 64);
+        }
+        set_bit(frag.first, begin);
+        set_bit(frag.last, begin + str.size() - 1);
+        set_bit(_word_ends, begin + str.size() - 1);
+        return frag;
+    }
+
+    // Marks the positions from which a position of _last can be reached.
+    // Positions of a join whose other operand cannot match still take part
+    // in the counters of scan, but never in a viable prefix.
+    auto mark_viable() -> void {
+        std::vector<std::vector<std::size_t>> predecessors(_position_number);
+        for (std::size_t position = 0; position < _position_number; ++position) {
+            const auto * row = follow(position);
+            for (std::size_t i = 0; i < _word_number; ++i)
+                for (auto bits = row[i]; bits; bits &= bits - 1)
+                    predecessors[i * 64 + count_trailing_zeros(bits)].push_back(position);
+        }
+        _viable = _last;
+        std::vector<std::size_t> stack;
+        for (std::size_t i = 0; i < _word_number; ++i)
+            for (auto bits = _last[i]; bits; bits &= bits - 1)
+                stack.push_back(i * 64 + count_trailing_zeros(bits));
+        while (!stack.empty()) {
+            const auto position = stack.back();
+            stack.pop_back();
+            for (const auto predecessor : predecessors[position]) {
+                auto & bits = _viable[predecessor / 64];
+                const auto bit = std::uint64_t{1} << (predecessor % 64);
+                if (bits & bit)
+                    continue;
+                bits |= bit;
+                stack.push_back(predecessor);
+            }
+        }
+    }
+
+    auto build_tables() -> void {
+        const std::size_t group_number = (_position_number + 7) / 8;
+        _tables.assign(group_number * 256 * _word_number, 0);
+        for (std::size_t k = 0; k < group_number; ++k)
+            for (std::size_t byte = 1; byte < 256; ++byte) {
+                const auto position = k * 8 + count_trailing_zeros(byte);
+                if (position >= _position_number)
+                    continue;
+                auto * row = _tables.data() + (k * 256 + byte) * _word_number;
+                const auto * rest = _tables.data() + (k * 256 + (byte & (byte - 1))) * _word_number;
+                const auto * row_of_position = follow(position);
+                for (std::size_t i = 0; i < _word_number; ++i)
+                    row[i] = rest[i] | row_of_position[i];
+            }
+    }
+
+    std::size_t _position_number{};
+    std::size_t _word_number{1};
+    bool _nullable{};
+    std::vector<std::uint64_t> _first;
+    std::vector<std::uint64_t> _last;
+    std::vector<std::uint64_t> _viable;
+    std::vector<std::uint64_t> _word_ends;
+    std::vector<std::uint64_t> _follow;
+    std::vector<std::uint64_t> _labels;
+    std::vector<unsigned char> _labels_of_positions;
+    std::vector<std::uint64_t> _tables;
+};
+
+// Determinizes a glushkov_nfa on demand. States are created the first time
+// a scan reaches them and stay cached for every later input, so a warmed up
+// scan costs one table lookup per byte. When the cache outgrows its budget it
+// is flushed; an input that keeps flushing it is finished on the NFA instead.
+class lazy_dfa {
+public:
+    static constexpr std::size_t default_cache_size = 1 << 18;
+    static constexpr std::size_t max_flush_number_per_input = 2;
+
+    explicit lazy_dfa(const grammer & root, std::size_t cache_size = default_cache_size)
+        : _nfa{root}
+        , _cache_size{cache_size}
+    {
+        clear_cache();
+    }
+
+    auto nfa() const -> const glushkov_nfa & {
+        return _nfa;
+    }
+
+    auto state_number() const -> std::size_t {
+        return _attributes.size();
+    }
+
+    auto flush_number() const -> std::size_t {
+        return _flush_number;
+    }
+
+    auto fallback_number() const -> std::size_t {
+        return _fallback_number;
+    }
+
+    // Same result and counters as glushkov_nfa::recognize.
+    auto recognize(std::string_view str, context & ctx) -> bool {
+        const auto match_count = ctx.match_count;
+        const auto compare_count = ctx.compare_count;
+        ctx.compare_count += 1;
+        bool accepted_early = !str.empty() && _nfa.nullable();
+        bool accepted = str.empty() && _nfa.nullable();
+        std::size_t flush_number = 0;
+        std::uint32_t state = start_state;
+        for (std::size_t i = 0; i < str.size(); ++i) {
+            const auto c = static_cast<unsigned char>(str[i]);
+            auto next = _transitions[state * 256 + c];
+            if (next == unknown_state)
+                next = transition(state, c);
+            while (next == unknown_state) {
+                if (++flush_number > max_flush_number_per_input || (state = flush(state)) == unknown_state) {
+                    ctx.match_count = match_count;
+                    ctx.compare_count = compare_count;
+                    ++_fallback_number;
+                    return _nfa.recognize(str, ctx);
+                }
+                next = transition(state, c);
+            }
+            state = next;
+            const auto & attr = _attributes[state];
+            ctx.compare_count += attr.position_number;
+            ctx.match_count += attr.word_end_number;
+            if (state == dead_state)
+                break;
+            if (attr.accepting) {
+                if (i + 1 == str.size())
+                    accepted = true;
+                else
+                    accepted_early = true;
+            }
+        }
+        return accepted && !accepted_early;
+    }
+
+    auto evaluate(std::string_view str, context & ctx) -> double {
+        ctx.reset();
+        return grammer::score(recognize(str, ctx), ctx);
+    }
+
+private:
+    static constexpr std::uint32_t unknown_state = ~std::uint32_t{0};
+    static constexpr std::uint32_t dead_state = 0;
+    static constexpr std::uint32_t start_state = 1;
+
+    struct attributes {
+        bool accepting;
+        std::uint32_t position_number;
+        std::uint32_t word_end_number;
+    };
+
+    auto state_cost() const -> std::size_t {
+        return 256 * sizeof(std::uint32_t) + 2 * _nfa.word_number() * sizeof(std::uint64_t) + sizeof(attributes) + 64;
+    }
+
+    auto set_of(std::uint32_t state) const -> const std::uint64_t * {
+        return _sets.data() + state * _nfa.word_number();
+    }
+
+    auto clear_cache() -> void {
+        _transitions.clear();
+        _sets.clear();
+        _attributes.clear();
+        _ids.clear();
+        const std::vector<std::uint64_t> empty(_nfa.word_number());
+        add_state(empty.data());
+        _transitions.insert(_transitions.end(), 256, unknown_state);
+        _sets.insert(_sets.end(), empty.begin(), empty.end());
+        _attributes.push_back({_nfa.nullable(), 0, 0});
+        std::fill(_transitions.begin(), _transitions.begin() + 256, dead_state);
+    }
+
+    // Keeps only the state the scan is in, which is re-created after the dead
+    // and start states, and returns its new id.
+    auto flush(std::uint32_t state) -> std::uint32_t {
+        ++_flush_number;
+        if (state == start_state || state == dead_state) {
+            clear_cache();
+            return state;
+        }
+        const std::vector<std::uint64_t> current(set_of(state), set_of(state) + _nfa.word_number());
+        clear_cache();
+        return add_state(current.data());
+    }
+
+    auto add_state(const std::uint64_t * bits) -> std::uint32_t {
+        const auto word_number = _nfa.word_number();
+        std::string key(reinterpret_cast<const char *>(bits), word_number * sizeof(std::uint64_t));
+        auto found = _ids.find(key);
+        if (found != _ids.end())
+            return found->second;
+        if (!_attributes.empty() && (_attributes.size() + 1) * state_cost() > _cache_size)
+            return unknown_state;
+        attributes attr{false, 0, 0};
+        for (std::size_t i = 0; i < word_number; ++i) {
+            attr.accepting = attr.accepting || (bits[i] & _nfa.last()[i]);
+            attr.position_number += static_cast<std::uint32_t>(count_bits(bits[i]));
+            attr.word_end_number += static_cast<std::uint32_t>(count_bits(bits[i] & _nfa.word_ends()[i]));
+        }
+        const auto id = static_cast<std::uint32_t>(_attributes.size());
+        _transitions.insert(_transitions.end(), 256, unknown_state);
+        _sets.insert(_sets.end(), bits, bits + word_number);
+        _attributes.push_back(attr);
+        _ids.emplace(std::move(key), id);
+        return id;
+    }
+
+    auto transition(std::uint32_t state, unsigned char c) -> std::uint32_t {
+        _buffer.resize(_nfa.word_number());
+        _nfa.step(state == start_state ? nullptr : set_of(state), c, _buffer.data());
+        const auto next = add_state(_buffer.data());
+        if (next != unknown_state)
+            _transitions[state * 256 + c] = next;
+        return next;
+    }
+
+    glushkov_nfa _nfa;
+    std::size_t _cache_size;
+    std::size_t _flush_number{};
+    std::size_t _fallback_number{};
+    std::vector<std::uint32_t> _transitions;
+    std::vector<std::uint64_t> _sets;
+    std::vector<attributes> _attributes;
+    std::unordered_map<std::string, std::uint32_t> _ids;
+    std::vector<std::uint64_t> _buffer;
+};
+
+// Linear program of a grammer tree executed by a Pike VM. Every byte of every
+// word becomes one char instruction, so threads correspond one to one with
+// the positions of glushkov_nfa and the counters of both engines agree.
+class pike_vm {
+public:
+    enum class opcode : std::uint8_t {
+        char_,
+        split,
+        jump,
+        match,
+        fail
+    };
+
+    struct instruction {
+        opcode op;
+        unsigned char c;
+        bool word_end;
+        std::uint32_t x;
+        std::uint32_t y;
+    };
+
+    explicit pike_vm(const grammer & root) {
+        compile(root);
+        emit(opcode::match);
+        _clist.resize(_program.size());
+        _nlist.resize(_program.size());
+    }
+
+    auto program() const -> const std::vector<instruction> & {
+        return _program;
+    }
+
+    // Same result and counters as glushkov_nfa::recognize.
+    auto recognize(std::string_view str, context & ctx) -> bool {
+        ctx.compare_count += 1;
+        _clist.clear();
+        add_thread(_clist, 0);
+        bool accepted_early = !str.empty() && _clist.matched;
+        bool accepted = str.empty() && _clist.matched;
+        for (std::size_t i = 0; i < str.size(); ++i) {
+            const auto c = static_cast<unsigned char>(str[i]);
+            _nlist.clear();
+            for (std::size_t j = 0; j < _clist.size; ++j) {
+                const auto & inst = _program[_clist.dense[j]];
+                if (inst.op != opcode::char_ || inst.c != c)
+                    continue;
+                ctx.compare_count += 1;
+                ctx.match_count += inst.word_end;
+                add_thread(_nlist, _clist.dense[j] + 1);
+            }
+            std::swap(_clist, _nlist);
+            if (_clist.size == 0)
+                break;
+            if (_clist.matched) {
+                if (i + 1 == str.size())
+                    accepted = true;
+                else
+                    accepted_early = true;
+            }
+        }
+        return accepted && !accepted_early;
+    }
+
+    auto evaluate(std::string_view str, context & ctx) -> double {
+        ctx.reset();
+        return grammer::score(recognize(str, ctx), ctx);
+    }
+
+private:
+    // Sparse set of program counters: constant time insertion, membership
+    // test and clearing regardless of the program length.
+    struct thread_list {
+        auto resize(std::size_t n) -> void {
+            dense.resize(n);
+            sparse.resize(n);
+        }
+
+        auto clear() -> void {
+            size = 0;
+            matched = false;
+        }
+
+        auto contains(std::uint32_t pc) const -> bool {
+            return sparse[pc] < size && dense[sparse[pc]] == pc;
+        }
+
+        auto insert(std::uint32_t pc) -> void {
+            sparse[pc] = static_cast<std::uint32_t>(size);
+            dense[size++] = pc;
+        }
+
+        std::vector<std::uint32_t> dense;
+        std::vector<std::uint32_t> sparse;
+        std::size_t size{};
+        bool matched{};
+    };
+
+    auto emit(opcode op, unsigned char c = 0, bool word_end = false) -> std::uint32_t {
+        _program.push_back({op, c, word_end, 0, 0});
+        return static_cast<std::uint32_t>(_program.size() - 1);
+    }
+
+    auto here() const -> std::uint32_t {
+        return static_cast<std::uint32_t>(_program.size());
+    }
+
+    // Emits the program of the subtree with a stack of tasks. Besides
+    // compiling a node, a task can finish an or_ after its first branch or
+    // patch the target of a split or jump once the code it skips is emitted.
+    auto compile(const grammer & root) -> void {
+        enum class step { node, or_second, patch_split, patch_jump };
+        struct task {
+            step kind;
+            const grammer * node;
+            std::uint32_t pc;
+        };
+        std::vector<task> tasks{{step::node, &root, 0}};
+        while (!tasks.empty()) {
+            const auto [kind, node, pc] = tasks.back();
+            tasks.pop_back();
+            if (kind == step::or_second) {
+                const auto jump = emit(opcode::jump);
+                _program[pc].y = here();
+                tasks.push_back({step::patch_jump, nullptr, jump});
+                tasks.push_back({step::node, node->second.get(), 0});
+                continue;
+            }
+            if (kind == step::patch_split) {
+                _program[pc].y = here();
+                continue;
+            }
+            if (kind == step::patch_jump) {
+                _program[pc].x = here();
+                continue;
+            }
+            if (auto w = dynamic_cast<const word *>(node)) {
+                const auto str = w->literal();
+                for (std::size_t i = 0; i < str.size(); ++i)
+                    emit(opcode::char_, static_cast<unsigned char>(str[i]), i + 1 == str.size());
+                continue;
+            }
+            if (dynamic_cast<const join *>(node)) {
+                if (!(node->first && node->second)) {
+                    emit(opcode::fail);
+                    continue;
+                }
+                tasks.push_back({step::node, node->second.get(), 0});
+                tasks.push_back({step::node, node->first.get(), 0});
+                continue;
+            }
+            if (dynamic_cast<const or_ *>(node)) {
+                if (!node->first && !node->second) {
+                    emit(opcode::fail);
+                    continue;
+                }
+                if (!node->first || !node->second) {
+                    tasks.push_back({step::node, node->first ? node->first.get() : node->second.get(), 0});
+                    continue;
+                }
+                const auto split = emit(opcode::split);
+                _program[split].x = here();
+                tasks.push_back({step::or_second, node, split});
+                tasks.push_back({step::node, node->first.get(), 0});
+                continue;
+            }
+            if (!node->first)
+                continue;
+            const auto split = emit(opcode::split);
+            _program[split].x = here();
+            tasks.push_back({step::patch_split, nullptr, split});
+            tasks.push_back({step::node, node->first.get(), 0});
+        }
+    }
+
+    // Follows jump and split instructions from pc and records every
+    // instruction reached in list. Uses computed goto where available.
+    auto add_thread(thread_list & list, std::uint32_t pc) -> void {
+        _stack.clear();
+#if defined(__GNUC__) || defined(__clang__)
+        static void * const dispatch_table[] = {&&op_char, &&op_split, &&op_jump, &&op_match, &&op_fail};
+    dispatch:
+        if (list.contains(pc))
+            goto next;
+        list.insert(pc);
+        goto *dispatch_table[static_cast<std::size_t>(_program[pc].op)];
+    op_split:
+        _stack.push_back(_program[pc].y);
+        pc = _program[pc].x;
+        goto dispatch;
+    op_jump:
+        pc = _program[pc].x;
+        goto dispatch;
+    op_match:
+        list.matched = true;
+        goto next;
+    op_char:
+    op_fail:
+    next:
+        if (_stack.empty())
+            return;
+        pc = _stack.back();
+        _stack.pop_back();
+        goto dispatch;
+#else
+        _stack.push_back(pc);
+        while (!_stack.empty()) {
+            pc = _stack.back();
+            _stack.pop_back();
+            while (!list.contains(pc)) {
+                list.insert(pc);
+                const auto & inst = _program[pc];
+                if (inst.op == opcode::split) {
+                    _stack.push_back(inst.y);
+                    pc = inst.x;
+                } else if (inst.op == opcode::jump) {
+                    pc = inst.x;
+                } else {
+                    if (inst.op == opcode::match)
+                        list.matched = true;
+                    break;
+                }
+            }
+        }
+#endif
+    }
+
+    std::vector<instruction> _program;
+    thread_list _clist;
+    thread_list _nlist;
+    std::vector<std::uint32_t> _stack;
+};
+
+// Up to lane_number inputs transposed into column layout: column i holds the
+// i-th byte of every lane, so one vector compare tests a byte in all lanes.
+class input_batch {
+public:
+    static constexpr std::size_t lane_number = 32;
+
+    input_batch(const std::string * inputs, std::size_t input_number) {
+        if (input_number > lane_number)
+            throw std::invalid_argument("input_number must be less or equal than lane_number.");
+        _lanes = input_number == lane_number ? ~std::uint32_t{0} : (std::uint32_t{1} << input_number) - 1;
+        std::size_t length = 0;
+        for (std::size_t lane = 0; lane < input_number; ++lane)
+            length = std::max(length, inputs[lane].size());
+        _columns.assign(length * lane_number, 0);
+        _alive.assign(length, 0);
+        _ends.assign(length, 0);
+        for (std::size_t lane = 0; lane < input_number; ++lane) {
+            const auto & input = inputs[lane];
+            const auto bit = std::uint32_t{1} << lane;
+            if (input.empty())
+                _empty |= bit;
+            else
+                _ends[input.size() - 1] |= bit;
+            for (std::size_t i = 0; i < input.size(); ++i) {
+                _columns[i * lane_number + lane] = static_cast<unsigned char>(input[i]);
+                _alive[i] |= bit;
+            }
+        }
+    }
+
+    auto length() const -> std::size_t {
+        return _alive.size();
+    }
+
+    auto lanes() const -> std::uint32_t {
+        return _lanes;
+    }
+
+    auto empty_lanes() const -> std::uint32_t {
+        return _empty;
+    }
+
+    // Lanes that still have a byte in the given column.
+    auto alive_lanes(std::size_t column) const -> std::uint32_t {
+        return _alive[column];
+    }
+
+    // Lanes whose last byte is in the given column.
+    auto end_lanes(std::size_t column) const -> std::uint32_t {
+        return _ends[column];
+    }
+
+    // Lanes whose byte in the given column is c, including lanes that are
+    // already past their end; callers mask those with alive_lanes.
+    auto byte_lanes(std::size_t column, unsigned char c) const -> std::uint32_t {
+        const auto * data = _columns.data() + column * lane_number;
+#if defined(__AVX2__)
+        const auto bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data));
+        const auto equal = _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(static_cast<char>(c)));
+        return static_cast<std::uint32_t>(_mm256_movemask_epi8(equal));
+#elif defined(__SSE2__)
+        const auto pattern = _mm_set1_epi8(static_cast<char>(c));
+        const auto low = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data)), pattern);
+        const auto high = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 16)), pattern);
+        return static_cast<std::uint32_t>(_mm_movemask_epi8(low))
+            | (static_cast<std::uint32_t>(_mm_movemask_epi8(high)) << 16);
+#else
+        std::uint32_t lanes = 0;
+        for (std::size_t lane = 0; lane < lane_number; ++lane)
+            lanes |= static_cast<std::uint32_t>(data[lane] == c) << lane;
+        return lanes;
+#endif
+    }
+
+private:
+    std::vector<unsigned char> _columns;
+    std::vector<std::uint32_t> _alive;
+    std::vector<std::uint32_t> _ends;
+    std::uint32_t _lanes{};
+    std::uint32_t _empty{};
+};
+
+// Runs a glushkov_nfa over every lane of an input_batch at once. The state is
+// bit-sliced: each position holds a mask with one bit per lane, so one
+// 32-bit operation advances that position in all lanes and the per-byte work
+// is shared by the whole batch instead of being repeated per input.
+class lockstep_nfa {
+public:
+    explicit lockstep_nfa(const grammer & root)
+        : _nfa{root}
+    {
+        const auto position_number = _nfa.position_number();
+        std::vector<std::vector<std::uint32_t>> predecessors(position_number);
+        for (std::size_t p = 0; p < position_number; ++p) {
+            const auto * follow = _nfa.follow(p);
+            for (std::size_t i = 0; i < _nfa.word_number(); ++i)
+                for (auto bits = follow[i]; bits; bits &= bits - 1)
+                    predecessors[i * 64 + count_trailing_zeros(bits)].push_back(static_cast<std::uint32_t>(p));
+        }
+        std::map<unsigned char, std::uint32_t> label_indices;
+        for (std::size_t q = 0; q < position_number; ++q) {
+            const auto label = _nfa.label(q);
+            auto found = label_indices.emplace(label, static_cast<std::uint32_t>(_labels.size()));
+            if (found.second)
+                _labels.push_back(label);
+            position pos{};
+            pos.label_index = found.first->second;
+            pos.predecessor_begin = static_cast<std::uint32_t>(_predecessors.size());
+            _predecessors.insert(_predecessors.end(), predecessors[q].begin(), predecessors[q].end());
+            pos.predecessor_end = static_cast<std::uint32_t>(_predecessors.size());
+            pos.first = test(_nfa.first(), q);
+            pos.last = test(_nfa.last(), q);
+            pos.word_end = test(_nfa.word_ends(), q);
+            _positions.push_back(pos);
+        }
+    }
+
+    struct counters {
+        std::size_t match_count;
+        std::size_t compare_count;
+    };
+
+    // Returns the lanes that match in the sense of glushkov_nfa::recognize and
+    // adds each lane's counters to the element of the same index.
+    auto recognize(const input_batch & batch, counters * lane_counters) const -> std::uint32_t {
+        const auto lanes = batch.lanes();
+        for (std::size_t lane = 0; lane < input_batch::lane_number; ++lane)
+            if ((lanes >> lane) & 1)
+                lane_counters[lane].compare_count += 1;
+        std::uint32_t accepted = 0;
+        std::uint32_t accepted_early = 0;
+        if (_nfa.nullable()) {
+            accepted = batch.empty_lanes();
+            accepted_early = lanes & ~batch.empty_lanes();
+        }
+        std::vector<std::uint32_t> active(_positions.size());
+        std::vector<std::uint32_t> next(_positions.size());
+        std::vector<std::uint32_t> label_lanes(_labels.size());
+        std::vector<std::size_t> label_columns(_labels.size(), ~std::size_t{0});
+        for (std::size_t column = 0; column < batch.length(); ++column) {
+            const auto alive = batch.alive_lanes(column);
+            std::uint32_t any = 0;
+            std::uint32_t accepting = 0;
+            for (std::size_t q = 0; q < _positions.size(); ++q) {
+                const auto & pos = _positions[q];
+                std::uint32_t from = (column == 0 && pos.first) ? alive : 0;
+                for (auto i = pos.predecessor_begin; i < pos.predecessor_end; ++i)
+                    from |= active[_predecessors[i]];
+                next[q] = 0;
+                if (!from)
+                    continue;
+                if (label_columns[pos.label_index] != column) {
+                    label_columns[pos.label_index] = column;
+                    label_lanes[pos.label_index] = batch.byte_lanes(column, _labels[pos.label_index]) & alive;
+                }
+                const auto bits = from & label_lanes[pos.label_index];
+                next[q] = bits;
+                any |= bits;
+                if (pos.last)
+                    accepting |= bits;
+                for (auto rest = bits; rest; rest &= rest - 1) {
+                    auto & lane = lane_counters[count_trailing_zeros(rest)];
+                    lane.compare_count += 1;
+                    lane.match_count += pos.word_end;
+                }
+            }
+            std::swap(active, next);
+            const auto ends = batch.end_lanes(column);
+            accepted |= accepting & ends;
+            accepted_early |= accepting & ~ends;
+            if (!any)
+                break;
+        }
+        return accepted & ~accepted_early;
+    }
+
+    // Sum of grammer::score over the given lanes of the batch.
+    auto evaluate(const input_batch & batch, std::uint32_t lanes = ~std::uint32_t{0}) const -> double {
+        std::array<counters, input_batch::lane_number> lane_counters{};
+        const auto matched = recognize(batch, lane_counters.data());
+        double value = 0;
+        lanes &= batch.lanes();
+        for (std::size_t lane = 0; lane < input_batch::lane_number; ++lane)
+            if ((lanes >> lane) & 1)
+                value += grammer::score((matched >> lane) & 1, lane_counters[lane].match_count, lane_counters[lane].compare_count);
+        return value;
+    }
+
+private:
+    struct position {
+        std::uint32_t label_index;
+        std::uint32_t predecessor_begin;
+        std::uint32_t predecessor_end;
+        bool first;
+        bool last;
+        bool word_end;
+    };
+
+    static auto test(const std::uint64_t * bits, std::size_t position) -> bool {
+        return (bits[position / 64] >> (position % 64)) & 1;
+    }
+
+    glushkov_nfa _nfa;
+    std::vector<unsigned char> _labels;
+    std::vector<position> _positions;
+    std::vector<std::uint32_t> _predecessors;
+};
+
+// Fully determinized and minimized automaton of a grammer tree. Unlike the
+// engines used during evolution it answers plain membership: an input
+// matches when the whole of it is in the language of the tree.
+class dfa {
+public:
+    static constexpr std::size_t default_max_state_number = 1 << 16;
+
+    explicit dfa(const grammer & root, std::size_t max_state_number = default_max_state_number) {
+        const glushkov_nfa nfa{root};
+        build_byte_classes(nfa);
+        determinize(nfa, max_state_number);
+        minimize();
+    }
+
+    auto state_number() const -> std::size_t {
+        return _accepting.size();
+    }
+
+    auto class_number() const -> std::size_t {
+        return _class_number;
+    }
+
+    auto match(std::string_view str) const -> bool {
+        std::size_t state = _start;
+        for (auto c : str) {
+            state = _transitions[state * _class_number + _byte_classes[static_cast<unsigned char>(c)]];
+            if (state == _dead)
+                return false;
+        }
+        return _accepting[state];
+    }
+
+    // Emits a dependency-free C++ translation unit defining
+    // bool match(std::string_view) as a table-driven matcher.
+    auto write_cpp(std::ostream & out, std::string_view function_name = "match") const -> void {
+        const char * state_type = state_number() <= 0x100 ? "unsigned char"
+            : state_number() <= 0x10000 ? "unsigned short" : "unsigned int";
+        out << "#include <string_view>\n\n";
+        out << "namespace {\n\n";
+        out << "const " << (_class_number <= 0x100 ? "unsigned char" : "unsigned short") << " byte_classes[256] = {";
+        for (std::size_t i = 0; i < 256; ++i)
+            out << (i % 16 ? " " : "\n    ") << static_cast<unsigned>(_byte_classes[i]) << ",";
+        out << "\n};\n\n";
+        out << "const " << state_type << " transitions[" << state_number() << "][" << _class_number << "] = {\n";
+        for (std::size_t state = 0; state < state_number(); ++state) {
+            out << "    {";
+            for (std::size_t k = 0; k < _class_number; ++k)
+                out << (k ? ", " : "") << _transitions[state * _class_number + k];
+            out << "},\n";
+        }
+        out << "};\n\n";
+        out << "const bool accepting[" << state_number() << "] = {";
+        for (std::size_t state = 0; state < state_number(); ++state)
+            out << (state % 16 ? " " : "\n    ") << (_accepting[state] ? "true" : "false") << ",";
+        out << "\n};\n\n";
+        out << "} // namespace\n\n";
+        out << "bool " << function_name << "(std::string_view str) {\n";
+        out << "    unsigned state = " << _start << ";\n";
+        out << "    for (unsigned char c : str) {\n";
+        out << "        state = transitions[state][byte_classes[c]];\n";
+        out << "        if (state == " << _dead << ")\n";
+        out << "            return false;\n";
+        out << "    }\n";
+        out << "    return accepting[state];\n";
+        out << "}\n";
+    }
+
+private:
+    // Bytes that label the same positions behave identically, so the
+    // transition table only needs one column per such class.
+    auto build_byte_classes(const glushkov_nfa & nfa) -> void {
+        std::map<std::vector<std::uint64_t>, std::uint16_t> classes;
+        classes.emplace(std::vector<std::uint64_t>(nfa.word_number()), 0);
+        for (std::size_t c = 0; c < 256; ++c) {
+            const auto * bits = nfa.labels(static_cast<unsigned char>(c));
+            std::vector<std::uint64_t> key(bits, bits + nfa.word_number());
+            auto found = classes.emplace(std::move(key), static_cast<std::uint16_t>(classes.size()));
+            if (found.second)
+                _representatives.push_back(static_cast<unsigned char>(c));
+            _byte_classes[c] = found.first->second;
+        }
+        _class_number = classes.size();
+    }
+
+    auto determinize(const glushkov_nfa & nfa, std::size_t max_state_number) -> void {
+        const auto word_number = nfa.word_number();
+        std::map<std::vector<std::uint64_t>, std::size_t> ids;
+        std::vector<std::vector<std::uint64_t>> sets;
+        auto add_state = [&](std::vector<std::uint64_t> bits, bool accepting) {
+            if (sets.size() >= max_state_number)
+                throw std::runtime_error("dfa exceeds max_state_number.");
+            sets.push_back(std::move(bits));
+            _accepting.push_back(accepting);
+            _transitions.insert(_transitions.end(), _class_number, 0);
+            return sets.size() - 1;
+        };
+        _dead = add_state(std::vector<std::uint64_t>(word_number), false);
+        ids.emplace(sets[_dead], _dead);
+        _start = add_state(std::vector<std::uint64_t>(word_number), nfa.nullable());
+        std::vector<std::uint64_t> next(word_number);
+        for (std::size_t state = _start; state < sets.size(); ++state) {
+            for (std::size_t k = 1; k < _class_number; ++k) {
+                nfa.step(state == _start ? nullptr : sets[state].data(), _representatives[k - 1], next.data());
+                auto found = ids.find(next);
+                std::size_t id;
+                if (found != ids.end()) {
+                    id = found->second;
+                } else {
+                    id = add_state(next, nfa.accepts(next.data()));
+                    ids.emplace(next, id);
+                }
+                _transitions[state * _class_number + k] = static_cast<std::uint32_t>(id);
+            }
+        }
+    }
+
+    // Moore's partition refinement: states stay together while they agree
+    // on acceptance and on the blocks their transitions lead to.
+    auto minimize() -> void {
+        const auto n = state_number();
+        std::vector<std::uint32_t> block(n);
+        for (std::size_t state = 0; state < n; ++state)
+            block[state] = _accepting[state] ? 1 : 0;
+        std::size_t block_number = 0;
+        while (true) {
+            std::map<std::vector<std::uint32_t>, std::uint32_t> signatures;
+            std::vector<std::uint32_t> next_block(n);
+            std::vector<std::uint32_t> signature(_class_number + 1);
+            for (std::size_t state = 0; state < n; ++state) {
+                signature[0] = block[state];
+                for (std::size_t k = 0; k < _class_number; ++k)
+                    signature[k + 1] = block[_transitions[state * _class_number + k]];
+                auto found = signatures.emplace(signature, static_cast<std::uint32_t>(signatures.size()));
+                next_block[state] = found.first->second;
+            }
+            block = std::move(next_block);
+            if (signatures.size() == block_number)
+                break;
+            block_number = signatures.size();
+        }
+        std::vector<std::uint32_t> transitions(block_number * _class_number);
+        std::vector<bool> accepting(block_number);
+        for (std::size_t state = 0; state < n; ++state) {
+            for (std::size_t k = 0; k < _class_number; ++k)
+                transitions[block[state] * _class_number + k] = block[_transitions[state * _class_number + k]];
+            accepting[block[state]] = _accepting[state];
+        }
+        _transitions = std::move(transitions);
+        _accepting = std::move(accepting);
+        _start = block[_start];
+        _dead = block[_dead];
+    }
+
+    std::array<std::uint16_t, 256> _byte_classes{};
+    std::vector<unsigned char> _representatives;
+    std::size_t _class_number{};
+    std::vector<std::uint32_t> _transitions;
+    std::vector<bool> _accepting;
+    std::size_t _start{};
+    std::size_t _dead{};
+};
+
+auto write_recognizer(const grammer & root, std::ostream & out) -> void {
+    const dfa automaton{root};
+    out << "// Generated by grammergen from the following grammer.\n";
+    out << "// " << root << "\n\n";
+    automaton.write_cpp(out);
+}
+
+enum class node_kind : std::uint8_t {
+    join,
+    or_,
+    optional,
+    word
+};
+
+auto kind_of(const grammer & node) -> node_kind {
+    if (dynamic_cast<const join *>(&node))
+        return node_kind::join;
+    if (dynamic_cast<const or_ *>(&node))
+        return node_kind::or_;
+    if (dynamic_cast<const optional *>(&node))
+        return node_kind::optional;
+    return node_kind::word;
+}
+
+// Stores the nodes of root in prefix order, first operand before second, for
+// the index-based representations. push stores one node and returns its
+// index, and link(parent, is_second, index) makes that node an operand of
+// its parent. Operands a node does not use are skipped. Walks with an
+// explicit stack and returns the index of root.
+template<typename Push, typename Link>
+auto append_prefix_order(const grammer & root, Push push, Link link) -> std::uint32_t {
+    struct entry {
+        const grammer * node;
+        std::uint32_t parent;
+        bool is_second;
+    };
+    constexpr auto no_parent = ~std::uint32_t{0};
+    std::uint32_t root_index = 0;
+    std::vector<entry> stack{{&root, no_parent, false}};
+    while (!stack.empty()) {
+        const auto [node, parent, is_second] = stack.back();
+        stack.pop_back();
+        const std::uint32_t index = push(*node);
+        if (parent == no_parent)
+            root_index = index;
+        else
+            link(parent, is_second, index);
+        if (node->operand_number() >= 2 && node->second)
+            stack.push_back({node->second.get(), index, true});
+        if (node->operand_number() >= 1 && node->first)
+            stack.push_back({node->first.get(), index, false});
+    }
+    return root_index;
+}
+
+// Closed representation of a grammer tree: a tag and inline payload per node,
+// stored contiguously in prefix order with the root at index zero. parse and
+// parse_offsets switch on the tag instead of dispatching virtually, and give
+// exactly the candidates and counters of the class hierarchy they mirror.
+class flat_tree {
+public:
+    static constexpr std::uint32_t no_node = ~std::uint32_t{0};
+
+    struct node {
+        node_kind kind;
+        std::uint32_t first;
+        std::uint32_t second;
+        // One past the last node of the subtree.
+        std::uint32_t end;
+        std::uint32_t literal_offset;
+        std::uint32_t literal_size;
+        std::size_t size;
+        std::size_t min_length;
+        std::size_t max_length;
+        bool deterministic;
+    };
+
+    static constexpr std::size_t no_match = std::numeric_limits<std::size_t>::max();
+
+    // Lookahead sets index bytes by their value and the end of the input by
+    // end_of_input.
+    static constexpr std::size_t end_of_input = 256;
+    using lookahead_set = std::bitset<257>;
+
+    flat_tree() {}
+
+    explicit flat_tree(const grammer & root) {
+        add(root);
+        analyze_determinism();
+    }
+
+    auto nodes() const -> const std::vector<node> & {
+        return _nodes;
+    }
+
+    auto literal(const node & n) const -> std::string_view {
+        return std::string_view(_literals).substr(n.literal_offset, n.literal_size);
+    }
+
+    auto parse(std::uint32_t index, std::string_view str, context & ctx) const -> context::candidate_list {
+        context::candidate_list candidates;
+        parse(index, str, ctx, candidates);
+        return candidates;
+    }
+
+    auto parse(std::uint32_t index, std::string_view str, context & ctx, context::candidate_list & out) const -> void {
+        const auto & n = _nodes[index];
+        if (ctx.prune && str.size() < n.min_length) {
+            ctx.match_count += prefix_credit(index, str);
+            return;
+        }
+        if (ctx.deterministic && n.deterministic) {
+            const auto consumed = parse_single(index, str, ctx);
+            if (consumed != no_match)
+                ctx.push(out, str.substr(consumed));
+            return;
+        }
+        const auto begin = out.size();
+        if (ctx.memoize) {
+            auto found = ctx.memo.find(context::memo_key{&n, str.size()});
+            if (found != ctx.memo.end()) {
+                for (auto candidate : found->second)
+                    ctx.push(out, candidate);
+                return;
+            }
+        }
+        ctx.compare_count += n.size;
+        switch (n.kind) {
+        case node_kind::join:
+            if (n.first != no_node && n.second != no_node) {
+                auto & rests = ctx.acquire_scratch();
+                parse(n.first, str, ctx, rests);
+                for (auto rest : rests)
+                    parse(n.second, rest, ctx, out);
+                ctx.release_scratch();
+            }
+            break;
+        case node_kind::or_:
+            if (n.first != no_node)
+                parse(n.first, str, ctx, out);
+            if (n.second != no_node)
+                parse(n.second, str, ctx, out);
+            break;
+        case node_kind::optional:
+            if (n.first != no_node)
+                parse(n.first, str, ctx, out);
+            ctx.push(out, str);
+            break;
+        case node_kind::word: {
+            const auto lit = literal(n);
+            if (starts_with_literal(str, lit)) {
+                ctx.push(out, std::string_view(str.data() + lit.size(), str.size() - lit.size()));
+                ctx.match_count += 1;
+            }
+            break;
+        }
+        }
+        if (ctx.memoize) {
+            ctx.memo.emplace(context::memo_key{&n, str.size()}, context::candidate_list(out.begin() + begin, out.end()));
+            ++ctx.allocation_count;
+        }
+    }
+
+#if defined(__cpp_impl_coroutine)
+    // Yields the same candidates as parse, one at a time: join feeds each
+    // remainder of its first operand to its second operand as soon as it is
+    // found, and consumers can stop before the rest is enumerated.
+    auto parse_lazy(std::uint32_t index, std::string_view str, context & ctx) const -> generator<std::string_view> {
+        const auto & n = _nodes[index];
+        ctx.compare_count += n.size;
+        switch (n.kind) {
+        case node_kind::join:
+            if (n.first != no_node && n.second != no_node)
+                for (auto rest : parse_lazy(n.first, str, ctx))
+                    for (auto s : parse_lazy(n.second, rest, ctx))
+                        co_yield s;
+            break;
+        case node_kind::or_:
+            if (n.first != no_node)
+                for (auto rest : parse_lazy(n.first, str, ctx))
+                    co_yield rest;
+            if (n.second != no_node)
+                for (auto rest : parse_lazy(n.second, str, ctx))
+                    co_yield rest;
+            break;
+        case node_kind::optional:
+            if (n.first != no_node)
+                for (auto rest : parse_lazy(n.first, str, ctx))
+                    co_yield rest;
+            co_yield str;
+            break;
+        case node_kind::word: {
+            const auto lit = literal(n);
+            if (starts_with_literal(str, lit)) {
+                ctx.match_count += 1;
+                co_yield str.substr(lit.size());
+            }
+            break;
+        }
+        }
+    }
+
+    // grammer::match without enumerating every candidate: the first
+    // non-empty remainder already rules out a match.
+    auto match_lazy(std::string_view str, context & ctx) const -> bool {
+        bool matched = false;
+        for (auto rest : parse_lazy(0, str, ctx)) {
+            if (!rest.empty())
+                return false;
+            matched = true;
+        }
+        return matched;
+    }
+
+    // Plain membership: stops at the first empty remainder.
+    auto accepts_lazy(std::string_view str, context & ctx) const -> bool {
+        for (auto rest : parse_lazy(0, str, ctx))
+            if (rest.empty())
+                return true;
+        return false;
+    }
+#endif
+
+    // Parses a subtree marked deterministic and returns the number of bytes
+    // consumed by its only candidate that can survive, or no_match.
+    auto parse_single(std::uint32_t index, std::string_view str, context & ctx) const -> std::size_t {
+        const auto & n = _nodes[index];
+        const auto & choice = _choices[index];
+        const auto lookahead = str.empty() ? end_of_input : static_cast<unsigned char>(str[0]);
+        ctx.compare_count += n.size;
+        switch (n.kind) {
+        case node_kind::join: {
+            if (n.first == no_node || n.second == no_node)
+                return no_match;
+            const auto a = parse_single(n.first, str, ctx);
+            if (a == no_match)
+                return no_match;
+            const auto b = parse_single(n.second, str.substr(a), ctx);
+            return b == no_match ? no_match : a + b;
+        }
+        case node_kind::or_:
+            if (choice.first.test(lookahead))
+                return parse_single(n.first, str, ctx);
+            if (choice.second.test(lookahead))
+                return parse_single(n.second, str, ctx);
+            return no_match;
+        case node_kind::optional:
+            if (choice.first.test(lookahead))
+                return parse_single(n.first, str, ctx);
+            return 0;
+        case node_kind::word: {
+            const auto lit = literal(n);
+            if (!starts_with_literal(str, lit))
+                return no_match;
+            ctx.match_count += 1;
+            return lit.size();
+        }
+        }
+        return no_match;
+    }
+
+    auto parse_offsets(std::uint32_t index, std::string_view input, std::size_t offset, context & ctx) const -> offset_set {
+        const auto & n = _nodes[index];
+        if (ctx.prune && input.size() - offset < n.min_length) {
+            ctx.match_count += prefix_credit(index, input.substr(offset));
+            return offset_set{input.size()};
+        }
+        if (ctx.memoize) {
+            auto found = ctx.offset_memo.find(context::memo_key{&n, offset});
+            if (found != ctx.offset_memo.end())
+                return found->second;
+        }
+        ctx.compare_count += n.size;
+        offset_set offsets{input.size()};
+        switch (n.kind) {
+        case node_kind::join:
+            if (n.first != no_node && n.second != no_node)
+                parse_offsets(n.first, input, offset, ctx).for_each([&](std::size_t rest){
+                    offsets |= parse_offsets(n.second, input, rest, ctx);
+                });
+            break;
+        case node_kind::or_:
+            if (n.first != no_node)
+                offsets |= parse_offsets(n.first, input, offset, ctx);
+            if (n.second != no_node)
+                offsets |= parse_offsets(n.second, input, offset, ctx);
+            break;
+        case node_kind::optional:
+            if (n.first != no_node)
+                offsets |= parse_offsets(n.first, input, offset, ctx);
+            offsets.insert(offset);
+            break;
+        case node_kind::word: {
+            const auto lit = literal(n);
+            if (starts_with_literal(input.substr(offset), lit)) {
+                offsets.insert(offset + lit.size());
+                ctx.match_count += 1;
+            }
+            break;
+        }
+        }
+        if (ctx.memoize)
+            ctx.offset_memo.emplace(context::memo_key{&n, offset}, offsets);
+        return offsets;
+    }
+
+    auto evaluate(std::string_view str, context & ctx) const -> double {
+        ctx.reset();
+        if (ctx.prune && !within_lengths(str)) {
+            ctx.match_count += prefix_credit(0, str);
+            return grammer::score(false, ctx);
+        }
+        parse(0, str, ctx, ctx.candidates);
+        return grammer::score(grammer::match(ctx.candidates), ctx);
+    }
+
+    auto evaluate_offsets(std::string_view str, context & ctx) const -> double {
+        ctx.reset();
+        if (ctx.prune && !within_lengths(str)) {
+            ctx.match_count += prefix_credit(0, str);
+            return grammer::score(false, ctx);
+        }
+        auto offsets = parse_offsets(0, str, 0, ctx);
+        return grammer::score(grammer::match(offsets, str.size()), ctx);
+    }
+
+private:
+    struct choice_sets {
+        lookahead_set first;
+        lookahead_set second;
+    };
+
+    auto matchable(std::uint32_t index) const -> bool {
+        return index != no_node && _nodes[index].min_length <= _nodes[index].max_length;
+    }
+
+    auto nullable(std::uint32_t index) const -> bool {
+        return matchable(index) && _nodes[index].min_length == 0;
+    }
+
+    // Bytes that can start a non-empty match of the subtree, together with
+    // follow when the subtree can also match the empty string.
+    auto lookahead(std::uint32_t index, const lookahead_set & follow) const -> lookahead_set {
+        if (!matchable(index))
+            return lookahead_set{};
+        auto set = _first_bytes[index];
+        if (nullable(index))
+            set |= follow;
+        return set;
+    }
+
+    // LL(1) analysis. Subtrees are analyzed against the set of lookaheads
+    // their continuation can accept; candidates outside it never reach the
+    // root. The root accepts every remainder, so the candidates of the root
+    // are never changed, only the failing ones inside it are skipped.
+    auto analyze_determinism() -> void {
+        _first_bytes.assign(_nodes.size(), lookahead_set{});
+        _choices.assign(_nodes.size(), choice_sets{});
+        for (auto index = _nodes.size(); index-- > 0;) {
+            const auto & n = _nodes[index];
+            auto & first = _first_bytes[index];
+            switch (n.kind) {
+            case node_kind::join:
+                if (matchable(static_cast<std::uint32_t>(index))) {
+                    first = _first_bytes[n.first];
+                    if (nullable(n.first))
+                        first |= _first_bytes[n.second];
+                }
+                break;
+            case node_kind::or_:
+                if (matchable(n.first))
+                    first |= _first_bytes[n.first];
+                if (matchable(n.second))
+                    first |= _first_bytes[n.second];
+                break;
+            case node_kind::optional:
+                if (matchable(n.first))
+                    first = _first_bytes[n.first];
+                break;
+            case node_kind::word:
+                if (n.literal_size)
+                    first.set(static_cast<unsigned char>(_literals[n.literal_offset]));
+                break;
+            }
+        }
+        if (!_nodes.empty())
+            mark_deterministic(0, lookahead_set{}.set());
+    }
+
+    // Operands are marked before their node, each against the lookaheads
+    // its continuation accepts, with an explicit stack.
+    auto mark_deterministic(std::uint32_t root, const lookahead_set & root_follow) -> bool {
+        struct frame {
+            std::uint32_t index;
+            lookahead_set follow;
+            bool expanded;
+        };
+        std::vector<frame> stack{{root, root_follow, false}};
+        while (!stack.empty()) {
+            const auto [index, follow, expanded] = stack.back();
+            stack.pop_back();
+            auto & n = _nodes[index];
+            if (!expanded) {
+                stack.push_back({index, follow, true});
+                switch (n.kind) {
+                case node_kind::join:
+                    if (n.first != no_node && n.second != no_node) {
+                        stack.push_back({n.second, follow, false});
+                        stack.push_back({n.first, lookahead(n.second, follow), false});
+                    }
+                    break;
+                case node_kind::or_:
+                    if (n.first != no_node)
+                        stack.push_back({n.first, follow, false});
+                    if (n.second != no_node)
+                        stack.push_back({n.second, follow, false});
+                    break;
+                case node_kind::optional:
+                    if (n.first != no_node)
+                        stack.push_back({n.first, follow, false});
+                    break;
+                case node_kind::word:
+                    break;
+                }
+                continue;
+            }
+            auto & choice = _choices[index];
+            bool deterministic = true;
+            switch (n.kind) {
+            case node_kind::join:
+                if (n.first != no_node && n.second != no_node)
+                    deterministic = _nodes[n.first].deterministic && _nodes[n.second].deterministic;
+                break;
+            case node_kind::or_:
+                if (n.first != no_node)
+                    deterministic = _nodes[n.first].deterministic && deterministic;
+                if (n.second != no_node)
+                    deterministic = _nodes[n.second].deterministic && deterministic;
+                choice.first = lookahead(n.first, follow);
+                choice.second = lookahead(n.second, follow);
+                deterministic = deterministic && (choice.first & choice.second).none();
+                break;
+            case node_kind::optional:
+                if (n.first != no_node) {
+                    deterministic = _nodes[n.first].deterministic;
+                    choice.first = lookahead(n.first, follow);
+                    deterministic = deterministic && (choice.first & follow).none();
+                }
+                break;
+            case node_kind::word:
+                break;
+            }
+            n.deterministic = deterministic || !matchable(index);
+        }
+        return _nodes[root].deterministic;
+    }
+
+    auto within_lengths(std::string_view str) const -> bool {
+        return _nodes[0].min_length <= str.size() && str.size() <= _nodes[0].max_length;
+    }
+
+    // Same as grammer::prefix_credit. A subtree is a contiguous range in
+    // prefix order, so its words are found without a stack.
+    auto prefix_credit(std::uint32_t index, std::string_view str) const -> std::size_t {
+        std::size_t credit = 0;
+        for (auto i = index; i < _nodes[index].end; ++i)
+            if (_nodes[i].kind == node_kind::word)
+                credit += starts_with_literal(str, literal(_nodes[i]));
+        return credit;
+    }
+
+    // Appends the subtree in prefix order. Each stack entry is a node, its
+    // parent and whether it is the parent's second operand.
+    auto add(const grammer & root) -> std::uint32_t {
+        const auto push = [&](const grammer & grm) {
+            const auto index = static_cast<std::uint32_t>(_nodes.size());
+            _nodes.push_back({kind_of(grm), no_node, no_node, index + 1, 0, 0, grm.size(), grm.min_length(), grm.max_length(), false});
+            if (_nodes[index].kind == node_kind::word) {
+                const auto lit = static_cast<const word &>(grm).literal();
+                _nodes[index].literal_offset = static_cast<std::uint32_t>(_literals.size());
+                _nodes[index].literal_size = static_cast<std::uint32_t>(lit.size());
+                _literals.append(lit);
+            }
+            return index;
+        };
+        const auto root_index = append_prefix_order(root, push, [&](std::uint32_t parent, bool is_second, std::uint32_t index) {
+            (is_second ? _nodes[parent].second : _nodes[parent].first) = index;
+        });
+        for (auto index = static_cast<std::uint32_t>(_nodes.size()); index-- > root_index;) {
+            auto & n = _nodes[index];
+            if (n.second != no_node)
+                n.end = _nodes[n.second].end;
+            else if (n.first != no_node)
+                n.end = _nodes[n.first].end;
+        }
+        return root_index;
+    }
+
+    std::vector<node> _nodes;
+    std::string _literals;
+    std::vector<lookahead_set> _first_bytes;
+    std::vector<choice_sets> _choices;
+};
+
+// Node storage for a whole population in structure-of-arrays form. Every tree
+// is a contiguous range of nodes in prefix order, child links are absolute
+// 32-bit indices into the store, and word nodes hold literal_ids. Cloning
+// and crossover append shifted copies of node ranges instead of allocating
+// nodes one by one.
+class population_store {
+public:
+    static constexpr std::uint32_t no_node = ~std::uint32_t{0};
+
+    struct tree {
+        std::uint32_t begin;
+        std::uint32_t end;
+    };
+
+    auto add(const grammer & root) -> tree {
+        const auto begin = node_number();
+        append(root);
+        for (auto index = node_number(); index-- > begin;)
+            update(index);
+        return {begin, node_number()};
+    }
+
+    auto clone(tree source) -> tree {
+        const auto begin = node_number();
+        copy(source.begin, source.end, [&](std::uint32_t child){
+            return child - source.begin + begin;
+        });
+        return {begin, node_number()};
+    }
+
+    // Copies receiver with the subtree at target replaced by a copy of the
+    // subtree at source. source may belong to any tree in the store.
+    auto crossover(tree receiver, std::uint32_t target, std::uint32_t source) -> tree {
+        const auto begin = node_number();
+        const auto target_end = target + _extents[target];
+        const auto source_end = source + _extents[source];
+        const auto inserted = begin + (target - receiver.begin);
+        const auto shift = [&](std::uint32_t child){
+            if (child <= target)
+                return child - receiver.begin + begin;
+            return child - target_end + inserted + _extents[source];
+        };
+        copy(receiver.begin, target, shift);
+        copy(source, source_end, [&](std::uint32_t child){
+            return child - source + inserted;
+        });
+        copy(target_end, receiver.end, shift);
+        for (auto index = inserted; index-- > begin;)
+            update(index);
+        return {begin, node_number()};
+    }
+
+    // Copies receiver with the node at target replaced by a node of kind k.
+    // The new node keeps the operands of the old one that it uses, like
+    // mutate_node followed by optimize_tree.
+    auto mutate(tree receiver, std::uint32_t target, node_kind k, literal_id literal) -> tree {
+        const auto begin = node_number();
+        const auto first = _firsts[target];
+        const auto second = _seconds[target];
+        const bool keep_first = k != node_kind::word && first != no_node;
+        const bool keep_second = (k == node_kind::join || k == node_kind::or_) && second != no_node;
+        const auto extent = 1 + (keep_first ? _extents[first] : 0) + (keep_second ? _extents[second] : 0);
+        const auto target_end = target + _extents[target];
+        const auto inserted = begin + (target - receiver.begin);
+        const auto shift = [&](std::uint32_t child){
+            if (child <= target)
+                return child - receiver.begin + begin;
+            return child - target_end + inserted + extent;
+        };
+        const auto copy_operand = [&](std::uint32_t operand) {
+            const auto operand_begin = node_number();
+            copy(operand, operand + _extents[operand], [&](std::uint32_t child){
+                return child - operand + operand_begin;
+            });
+            return operand_begin;
+        };
+        copy(receiver.begin, target, shift);
+        push(k, no_node, no_node, literal);
+        if (keep_first) {
+            const auto operand_begin = copy_operand(first);
+            _firsts[inserted] = operand_begin;
+        }
+        if (keep_second) {
+            const auto operand_begin = copy_operand(second);
+            _seconds[inserted] = operand_begin;
+        }
+        copy(target_end, receiver.end, shift);
+        for (auto index = inserted + 1; index-- > begin;)
+            update(index);
+        return {begin, node_number()};
+    }
+
+    // Number of nodes on the longest path from the node at index to a leaf.
+    auto depth(std::uint32_t index) const -> std::size_t {
+        std::size_t max_depth = 0;
+        std::vector<std::pair<std::uint32_t, std::size_t>> stack{{index, 1}};
+        while (!stack.empty()) {
+            const auto [node, level] = stack.back();
+            stack.pop_back();
+            max_depth = std::max(max_depth, level);
+            for (const auto operand : {_firsts[node], _seconds[node]})
+                if (operand != no_node)
+                    stack.emplace_back(operand, level + 1);
+        }
+        return max_depth;
+    }
+
+    // Drops every node that does not belong to one of trees, and updates
+    // trees to their new ranges.
+    auto compact(std::vector<tree> & trees) -> void {
+        population_store next;
+        for (auto & t : trees) {
+            const auto begin = next.node_number();
+            next.copy_from(*this, t.begin, t.end, [&](std::uint32_t child){
+                return child - t.begin + begin;
+            });
+            t = {begin, next.node_number()};
+        }
+        *this = std::move(next);
+    }
+
+    // Builds the operands before their node, with an explicit stack.
+    auto to_grammer(std::uint32_t root) const -> std::shared_ptr<grammer> {
+        std::vector<std::pair<std::uint32_t, bool>> stack{{root, false}};
+        std::vector<std::shared_ptr<grammer>> results;
+        const auto pop = [&] {
+            auto node = std::move(results.back());
+            results.pop_back();
+            return node;
+        };
+        while (!stack.empty()) {
+            const auto [index, expanded] = stack.back();
+            stack.pop_back();
+            if (index == no_node) {
+                results.emplace_back();
+                continue;
+            }
+            const auto kind = _kinds[index];
+            if (kind != node_kind::word && !expanded) {
+                stack.emplace_back(index, true);
+                if (kind != node_kind::optional)
+                    stack.emplace_back(_seconds[index], false);
+                stack.emplace_back(_firsts[index], false);
+                continue;
+            }
+            switch (kind) {
+            case node_kind::join: {
+                auto second = pop();
+                results.push_back(make_node<join>(pop(), std::move(second)));
+                break;
+            }
+            case node_kind::or_: {
+                auto second = pop();
+                results.push_back(make_node<or_>(pop(), std::move(second)));
+                break;
+            }
+            case node_kind::optional:
+                results.push_back(make_node<optional>(pop(), nullptr));
+                break;
+            case node_kind::word:
+                results.push_back(make_node<word>(_literal_ids[index]));
+                break;
+            }
+        }
+        return pop();
+    }
+
+    auto parse(std::uint32_t index, std::string_view str, context & ctx, context::candidate_list & out) const -> void {
+        ctx.compare_count += _sizes[index];
+        const auto first = _firsts[index];
+        const auto second = _seconds[index];
+        switch (_kinds[index]) {
+        case node_kind::join:
+            if (first != no_node && second != no_node) {
+                auto & rests = ctx.acquire_scratch();
+                parse(first, str, ctx, rests);
+                for (auto rest : rests)
+                    parse(second, rest, ctx, out);
+                ctx.release_scratch();
+            }
+            break;
+        case node_kind::or_:
+            if (first != no_node)
+                parse(first, str, ctx, out);
+            if (second != no_node)
+                parse(second, str, ctx, out);
+            break;
+        case node_kind::optional:
+            if (first != no_node)
+                parse(first, str, ctx, out);
+            ctx.push(out, str);
+            break;
+        case node_kind::word: {
+            const auto lit = literal(index);
+            if (starts_with_literal(str, lit)) {
+                ctx.push(out, str.substr(lit.size()));
+                ctx.match_count += 1;
+            }
+            break;
+        }
+        }
+    }
+
+    // Same score as grammer::evaluate without memoization, pruning or
+    // deterministic parsing, which this store does not support.
+    auto evaluate(tree t, std::string_view str, context & ctx) const -> double {
+        ctx.reset();
+        parse(t.begin, str, ctx, ctx.candidates);
+        return grammer::score(grammer::match(ctx.candidates), ctx);
+    }
+
+    auto node_number() const -> std::uint32_t {
+        return static_cast<std::uint32_t>(_kinds.size());
+    }
+
+    auto kind(std::uint32_t index) const -> node_kind {
+        return _kinds[index];
+    }
+
+    auto first(std::uint32_t index) const -> std::uint32_t {
+        return _firsts[index];
+    }
+
+    auto second(std::uint32_t index) const -> std::uint32_t {
+        return _seconds[index];
+    }
+
+    auto literal(std::uint32_t index) const -> std::string_view {
+        return literal_pool::get(_literal_ids[index]);
+    }
+
+    // Number of nodes in the subtree at index, itself included.
+    auto extent(std::uint32_t index) const -> std::uint32_t {
+        return _extents[index];
+    }
+
+    auto size(std::uint32_t index) const -> std::size_t {
+        return _sizes[index];
+    }
+
+private:
+    auto append(const grammer & root) -> std::uint32_t {
+        const auto push_node = [&](const grammer & grm) {
+            const auto index = node_number();
+            const auto k = kind_of(grm);
+            push(k, no_node, no_node, k == node_kind::word ? static_cast<const word &>(grm).id() : literal_id{});
+            return index;
+        };
+        return append_prefix_order(root, push_node, [&](std::uint32_t parent, bool is_second, std::uint32_t index) {
+            (is_second ? _seconds[parent] : _firsts[parent]) = index;
+        });
+    }
+
+    template<typename Shift>
+    auto copy(std::uint32_t begin, std::uint32_t end, Shift shift) -> void {
+        copy_from(*this, begin, end, shift);
+    }
+
+    template<typename Shift>
+    auto copy_from(const population_store & source, std::uint32_t begin, std::uint32_t end, Shift shift) -> void {
+        for (auto index = begin; index < end; ++index) {
+            const auto first = source._firsts[index];
+            const auto second = source._seconds[index];
+            push(source._kinds[index],
+                first == no_node ? no_node : shift(first),
+                second == no_node ? no_node : shift(second),
+                source._literal_ids[index]);
+            _extents.back() = source._extents[index];
+            _sizes.back() = source._sizes[index];
+        }
+    }
+
+    auto push(node_kind k, std::uint32_t first, std::uint32_t second, literal_id literal) -> void {
+        _kinds.push_back(k);
+        _firsts.push_back(first);
+        _seconds.push_back(second);
+        _literal_ids.push_back(literal);
+        _extents.push_back(1);
+        _sizes.push_back(1);
+    }
+
+    // Recomputes extent and size from the children, which must be up to date.
+    auto update(std::uint32_t index) -> void {
+        const auto first = _firsts[index];
+        const auto second = _seconds[index];
+        std::uint32_t extent = 1;
+        std::size_t size = 1;
+        if (first != no_node) {
+            extent += _extents[first];
+            size += _kinds[index] == node_kind::optional ? _sizes[first] * 2 : _sizes[first];
+        }
+        if (second != no_node) {
+            extent += _extents[second];
+            size += _sizes[second];
+        }
+        _extents[index] = extent;
+        _sizes[index] = size;
+    }
+
+    std::vector<node_kind> _kinds;
+    std::vector<std::uint32_t> _firsts;
+    std::vector<std::uint32_t> _seconds;
+    std::vector<literal_id> _literal_ids;
+    std::vector<std::uint32_t> _extents;
+    std::vector<std::size_t> _sizes;
+};
+
+// Necessary conditions for a full match that can be checked without parsing:
+// the first byte of the input and literals every matching input contains.
+class prefilter {
+public:
+    // Required literals beyond this many are dropped, shortest first.
+    static constexpr std::size_t max_literal_number = 4;
+
+    explicit prefilter(const grammer & root) {
+        auto attr = analyze(&root);
+        _matchable = attr.matchable;
+        _nullable = attr.nullable;
+        _first_bytes = attr.first_bytes;
+        for (auto & literal : attr.literals) {
+            const bool covered = std::any_of(attr.literals.begin(), attr.literals.end(), [&](const std::string & other){
+                return other.size() > literal.size() && other.find(literal) != std::string::npos;
+            });
+            if (!covered)
+                _literals.push_back(literal);
+        }
+        std::sort(_literals.begin(), _literals.end(), [](const std::string & a, const std::string & b){
+            return a.size() > b.size();
+        });
+        if (_literals.size() > max_literal_number)
+            _literals.resize(max_literal_number);
+    }
+
+    auto first_bytes() const -> const std::bitset<256> & {
+        return _first_bytes;
+    }
+
+    auto literals() const -> const std::vector<std::string> & {
+        return _literals;
+    }
+
+    // False only if str cannot be a full match of the analyzed tree.
+    auto can_match(std::string_view str) const -> bool {
+        if (!_matchable)
+            return false;
+        if (str.empty())
+            return _nullable;
+        if (!_first_bytes.test(static_cast<unsigned char>(str[0])))
+            return false;
+        for (const auto & literal : _literals)
+            if (!contains(str, literal))
+                return false;
+        return true;
+    }
+
+    // Score for an input rejected by can_match: one point for an acceptable
+    // first byte and one per required literal that the input contains.
+    auto partial_credit(std::string_view str) const -> double {
+        double value = 0;
+        if (!str.empty() && _first_bytes.test(static_cast<unsigned char>(str[0])))
+            value += 1;
+        for (const auto & literal : _literals)
+            if (contains(str, literal))
+                value += 1;
+        return value;
+    }
+
+    static auto contains(std::string_view str, std::string_view literal) -> bool {
+        if (literal.empty())
+            return true;
+        const char * it = str.data();
+        const char * end = str.data() + str.size();
+        while (static_cast<std::size_t>(end - it) >= literal.size()) {
+            it = static_cast<const char *>(std::memchr(it, literal[0], end - it - literal.size() + 1));
+            if (!it)
+                return false;
+            if (std::memcmp(it, literal.data(), literal.size()) == 0)
+                return true;
+            ++it;
+        }
+        return false;
+    }
+
+private:
+    struct attributes {
+        bool matchable{};
+        bool nullable{};
+        std::bitset<256> first_bytes;
+        bool exact{};
+        std::string exact_string;
+        std::vector<std::string> literals;
+    };
+
+    static auto add_literal(std::vector<std::string> & literals, const std::string & literal) -> void {
+        if (!literal.empty() && std::find(literals.begin(), literals.end(), literal) == literals.end())
+            literals.push_back(literal);
     }
 
-    virtual auto name() const -> const char * override {
-        return "?";
+    // Operands are treated as parse treats them: join needs both, or_ either,
+    // and a missing operand of optional is the empty string.
+    // Post-order walk with an explicit stack; the attributes of finished
+    // subtrees wait on results until their parent is combined.
+    static auto analyze(const grammer * root) -> attributes {
+        std::vector<std::pair<const grammer *, bool>> stack{{root, false}};
+        std::vector<attributes> results;
+        const auto pop = [&]() -> attributes {
+            auto attr = std::move(results.back());
+            results.pop_back();
+            return attr;
+        };
+        while (!stack.empty()) {
+            const auto [node, expanded] = stack.back();
+            stack.pop_back();
+            if (!node) {
+                results.emplace_back();
+                continue;
+            }
+            const auto kind = kind_of(*node);
+            const bool binary = kind == node_kind::or_ || (kind == node_kind::join && node->first && node->second);
+            if (kind == node_kind::word || expanded) {
+                auto b = binary ? pop() : attributes{};
+                auto a = binary || kind == node_kind::optional ? pop() : attributes{};
+                results.push_back(combine(node, std::move(a), std::move(b)));
+                continue;
+            }
+            stack.emplace_back(node, true);
+            if (binary)
+                stack.emplace_back(node->second.get(), false);
+            if (binary || kind == node_kind::optional)
+                stack.emplace_back(node->first.get(), false);
+        }
+        return pop();
     }
 
-    virtual auto operand_number() const -> std::size_t override {
-        return 1;
+    // Attributes of node from those of its operands; a and b are empty for
+    // a missing operand, and for join when either operand is missing.
+    static auto combine(const grammer * node, attributes a, attributes b) -> attributes {
+        attributes attr;
+        switch (kind_of(*node)) {
+        case node_kind::word: {
+            const auto literal = static_cast<const word *>(node)->literal();
+            attr.matchable = true;
+            attr.nullable = literal.empty();
+            if (!literal.empty())
+                attr.first_bytes.set(static_cast<unsigned char>(literal[0]));
+            attr.exact = true;
+            attr.exact_string = std::string(literal);
+            add_literal(attr.literals, attr.exact_string);
+            return attr;
+        }
+        case node_kind::join: {
+            if (!(node->first && node->second))
+                return attr;
+            if (!a.matchable || !b.matchable)
+                return attr;
+            attr.matchable = true;
+            attr.nullable = a.nullable && b.nullable;
+            attr.first_bytes = a.first_bytes;
+            if (a.nullable)
+                attr.first_bytes |= b.first_bytes;
+            attr.literals = std::move(a.literals);
+            for (const auto & literal : b.literals)
+                add_literal(attr.literals, literal);
+            if (a.exact && b.exact) {
+                attr.exact = true;
+                attr.exact_string = a.exact_string + b.exact_string;
+                add_literal(attr.literals, attr.exact_string);
+            }
+            return attr;
+        }
+        case node_kind::or_: {
+            if (!a.matchable)
+                return b;
+            if (!b.matchable)
+                return a;
+            attr.matchable = true;
+            attr.nullable = a.nullable || b.nullable;
+            attr.first_bytes = a.first_bytes | b.first_bytes;
+            for (const auto & literal : a.literals)
+                if (std::find(b.literals.begin(), b.literals.end(), literal) != b.literals.end())
+                    attr.literals.push_back(literal);
+            if (a.exact && b.exact && a.exact_string == b.exact_string) {
+                attr.exact = true;
+                attr.exact_string = a.exact_string;
+            }
+            return attr;
+        }
+        case node_kind::optional: {
+            attr.matchable = true;
+            attr.nullable = true;
+            if (a.matchable)
+                attr.first_bytes = a.first_bytes;
+            if (!a.matchable || (a.exact && a.exact_string.empty()))
+                attr.exact = true;
+            return attr;
+        }
+        }
+        return attr;
     }
+
+    bool _matchable{};
+    bool _nullable{};
+    std::bitset<256> _first_bytes;
+    std::vector<std::string> _literals;
 };
 
 template<typename Integral = int>
@@ -270,62 +3558,102 @@ auto generate_node() -> std::shared_ptr<grammer> {
     static bool has_been_initialized = false;
     static std::vector<std::function<std::shared_ptr<grammer>()>> functions;
     if (!has_been_initialized) {
-        functions.push_back([](){return std::make_shared<join>();});
-        functions.push_back([](){return std::make_shared<or_>();});
+        functions.push_back([](){return make_node<join>();});
+        functions.push_back([](){return make_node<or_>();});
         functions.push_back([](){
             char c;
             while (!std::isprint(c = static_cast<char>(random_integral<>(0, 0xff))));
-            return std::make_shared<word>(std::string_view{&c, 1});
+            return make_node<word>(std::string_view{&c, 1});
         });
-        functions.push_back([](){return std::make_shared<optional>();});
+        functions.push_back([](){return make_node<optional>();});
         has_been_initialized = true;
     }
     return random_element(functions)();
 }
 
 auto optimize_tree(const std::shared_ptr<grammer> & root) -> void {
-    struct impl {
-        static auto optimize_node(const std::shared_ptr<grammer> & node) -> void {
-            if (!node)
-                return;
-            if (node->operand_number() == 0) {
-                node->first = std::shared_ptr<grammer>{};
-                node->second = std::shared_ptr<grammer>{};
-            }
-            if (node->operand_number() == 1) {
-                optimize_node(node->first);
+    if (!root)
+        return;
+    // Unused operands are dropped top-down. Only the nodes that lose an
+    // operand and their ancestors are invalidated, so valid caches survive
+    // and the final hash() recomputes just those paths.
+    std::vector<std::pair<grammer *, std::size_t>> nodes{{root.get(), 0}};
+    std::vector<bool> invalidated(1);
+    std::vector<std::size_t> stack{0};
+    while (!stack.empty()) {
+        const auto index = stack.back();
+        stack.pop_back();
+        auto * node = nodes[index].first;
+        const auto operand_count = node->operand_number();
+        if ((operand_count < 2 && node->second) || (operand_count < 1 && node->first)) {
+            if (operand_count < 2)
                 node->second = std::shared_ptr<grammer>{};
-            }
-            if (node->operand_number() == 2) {
-                optimize_node(node->first);
-                optimize_node(node->second);
+            if (operand_count < 1)
+                node->first = std::shared_ptr<grammer>{};
+            for (auto k = index; !invalidated[k]; k = nodes[k].second) {
+                invalidated[k] = true;
+                nodes[k].first->invalidate_cache();
+                if (k == 0)
+                    break;
             }
         }
-    };
-    impl::optimize_node(root);
+        for (auto * operand : {node->second.get(), node->first.get()})
+            if (operand) {
+                stack.push_back(nodes.size());
+                nodes.emplace_back(operand, index);
+                invalidated.push_back(false);
+            }
+    }
+    root->hash();
+}
+
+// Number of nodes on the longest path from root to a leaf.
+auto depth(const grammer & root) -> std::size_t {
+    std::size_t max_depth = 0;
+    std::vector<std::pair<const grammer *, std::size_t>> stack{{&root, 1}};
+    while (!stack.empty()) {
+        const auto [node, level] = stack.back();
+        stack.pop_back();
+        max_depth = std::max(max_depth, level);
+        for (const auto * operand : {node->first.get(), node->second.get()})
+            if (operand)
+                stack.emplace_back(operand, level + 1);
+    }
+    return max_depth;
 }
 
-auto generate_tree(std::size_t node_number) -> std::shared_ptr<grammer> {
-    std::deque<std::reference_wrapper<std::shared_ptr<grammer>>> terminals;
+// Operand slots at max_depth are left empty, so the tree is at most
+// max_depth nodes deep.
+auto generate_tree(
+    std::size_t node_number,
+    std::size_t max_depth = std::numeric_limits<std::size_t>::max()
+) -> std::shared_ptr<grammer> {
+    std::deque<std::pair<std::reference_wrapper<std::shared_ptr<grammer>>, std::size_t>> terminals;
     if (node_number == 0)
         throw std::logic_error("node_number must be greater than zero.");
+    if (max_depth == 0)
+        throw std::logic_error("max_depth must be greater than zero.");
     auto root = generate_node();
-    if (root->operand_number() >= 1)
-        terminals.push_back(root->first);
-    if (root->operand_number() >= 2)
-        terminals.push_back(root->second);
+    const auto add_terminals = [&](grammer & node, std::size_t level) {
+        if (level >= max_depth)
+            return;
+        if (node.operand_number() >= 1)
+            terminals.emplace_back(node.first, level + 1);
+        if (node.operand_number() >= 2)
+            terminals.emplace_back(node.second, level + 1);
+    };
+    add_terminals(*root, 1);
     for (std::size_t i = 1; i < node_number; ++i) {
         if (terminals.empty())
             break;
         auto temp = generate_node();
         std::size_t index = random_integral<std::size_t>(0, terminals.size() - 1);
-        terminals[index].get() = temp;
+        const auto level = terminals[index].second;
+        terminals[index].first.get() = temp;
         terminals.erase(terminals.begin() + index);
-        if (temp->operand_number() >= 1)
-            terminals.push_back(temp->first);
-        if (temp->operand_number() >= 2)
-            terminals.push_back(temp->second);
+        add_terminals(*temp, level);
     }
+    root->hash();
     return root;
 }
 
@@ -335,26 +3663,23 @@ auto mutate_node(std::shared_ptr<grammer> & node) -> void {
     node = generate_node();
     node->first = first;
     node->second = second;
+    node->invalidate_cache();
 }
 
 auto get_nodes(
     std::shared_ptr<grammer> & root
 ) -> std::vector<std::reference_wrapper<std::shared_ptr<grammer>>> {
-    struct impl {
-        static auto push(
-            std::shared_ptr<grammer> & grm,
-            std::vector<std::reference_wrapper<std::shared_ptr<grammer>>> & vct
-        ) -> void
-        {
-            vct.push_back(std::ref(grm));
-            if (grm->first)
-                push(grm->first, vct);
-            if (grm->second)
-                push(grm->second, vct);
-        }
-    };
     std::vector<std::reference_wrapper<std::shared_ptr<grammer>>> vct;
-    impl::push(root, vct);
+    std::vector<std::shared_ptr<grammer> *> stack{&root};
+    while (!stack.empty()) {
+        auto & grm = *stack.back();
+        stack.pop_back();
+        vct.push_back(std::ref(grm));
+        if (grm->second)
+            stack.push_back(&grm->second);
+        if (grm->first)
+            stack.push_back(&grm->first);
+    }
     return vct;
 }
 
@@ -364,22 +3689,512 @@ auto random_select_node(
     return random_element(get_nodes(root));
 }
 
+// Operand slots from the root down to a uniformly chosen node. The node is
+// picked by its prefix-order index and reached by descending through the
+// cached node counts, so only the path is visited.
+auto random_node_path(const std::shared_ptr<grammer> & root) -> std::vector<const std::shared_ptr<grammer> *> {
+    std::vector<const std::shared_ptr<grammer> *> path{&root};
+    for (auto index = random_integral<std::size_t>(0, root->node_count() - 1); index; ) {
+        const auto & node = **path.back();
+        --index;
+        const auto first_count = node.first ? node.first->node_count() : 0;
+        if (index < first_count) {
+            path.push_back(&node.first);
+        } else {
+            index -= first_count;
+            path.push_back(&node.second);
+        }
+    }
+    return path;
+}
+
+// Invalidates the caches of the nodes above the last slot of path, after the
+// subtree in that slot has been replaced in place.
+auto invalidate_path(const std::vector<const std::shared_ptr<grammer> *> & path) -> void {
+    for (std::size_t i = 0; i + 1 < path.size(); ++i)
+        (*path[i])->invalidate_cache();
+}
+
 auto create_crossed_tree(
     const std::shared_ptr<grammer> & a_root,
     const std::shared_ptr<grammer> & b_root
 ) -> std::pair<std::shared_ptr<grammer>, std::shared_ptr<grammer>> {
     auto a_clone = a_root->clone();
     auto b_clone = b_root->clone();
-    auto a_nodes = get_nodes(a_clone);
-    auto b_nodes = get_nodes(b_clone);
+    const auto a_path = random_node_path(a_clone);
+    const auto b_path = random_node_path(b_clone);
     std::swap(
-        random_element(a_nodes).get(),
-        random_element(b_nodes).get()
+        const_cast<std::shared_ptr<grammer> &>(*a_path.back()),
+        const_cast<std::shared_ptr<grammer> &>(*b_path.back())
     );
+    // The clones keep the cached attributes of their parents, so only the
+    // paths down to the swapped subtrees are recomputed.
+    invalidate_path(a_path);
+    invalidate_path(b_path);
+    a_clone->hash();
+    b_clone->hash();
     return std::make_pair(a_clone, b_clone);
 }
 
-auto select_individual(std::vector<std::pair<std::shared_ptr<grammer>, double>> & individuals) -> std::shared_ptr<grammer>{
+// Returns a new root in which the node at the end of path is replaced.
+// Only the nodes on the path are copied; every other subtree is shared with
+// the original tree, which is left unchanged.
+auto replace_node(
+    const std::vector<const std::shared_ptr<grammer> *> & path,
+    std::shared_ptr<grammer> replacement
+) -> std::shared_ptr<grammer> {
+    for (auto i = path.size() - 1; i-- > 0;) {
+        auto copy = (*path[i])->copy();
+        copy->invalidate_cache();
+        if (&(*path[i])->first == path[i + 1])
+            copy->first = std::move(replacement);
+        else
+            copy->second = std::move(replacement);
+        replacement = std::move(copy);
+    }
+    return replacement;
+}
+
+// Persistent counterpart of create_crossed_tree: the parents are not
+// modified and the offspring share all subtrees off the swapped paths.
+auto create_shared_crossed_tree(
+    const std::shared_ptr<grammer> & a_root,
+    const std::shared_ptr<grammer> & b_root
+) -> std::pair<std::shared_ptr<grammer>, std::shared_ptr<grammer>> {
+    const auto a_path = random_node_path(a_root);
+    const auto b_path = random_node_path(b_root);
+    return std::make_pair(replace_node(a_path, *b_path.back()), replace_node(b_path, *a_path.back()));
+}
+
+// Persistent counterpart of mutate_node on a randomly chosen node.
+auto create_shared_mutated_tree(const std::shared_ptr<grammer> & root) -> std::shared_ptr<grammer> {
+    const auto path = random_node_path(root);
+    auto node = *path.back();
+    mutate_node(node);
+    return replace_node(path, node);
+}
+
+// Hash-consing table for subtrees. intern returns one shared node for every
+// distinct (kind, interned operands, literal), so identical subtrees across
+// the population exist once. Interned nodes are shared and must be cloned
+// before they are modified. The table holds weak references only, and
+// collect drops the entries of subtrees that are no longer used.
+class subtree_table {
+public:
+    // Interns the operands before their node, with an explicit stack; the
+    // canonical operands wait on results until their node is interned.
+    auto intern(const std::shared_ptr<grammer> & root) -> std::shared_ptr<grammer> {
+        std::vector<std::pair<const std::shared_ptr<grammer> *, bool>> stack{{&root, false}};
+        std::vector<std::shared_ptr<grammer>> results;
+        while (!stack.empty()) {
+            const auto [slot, expanded] = stack.back();
+            stack.pop_back();
+            const auto & node = *slot;
+            if (!node) {
+                results.emplace_back();
+                continue;
+            }
+            const auto kind = kind_of(*node);
+            if (kind != node_kind::word && !expanded) {
+                stack.emplace_back(slot, true);
+                if (kind != node_kind::optional)
+                    stack.emplace_back(&node->second, false);
+                stack.emplace_back(&node->first, false);
+                continue;
+            }
+            key k{kind, nullptr, nullptr, literal_id{}};
+            std::shared_ptr<grammer> first, second;
+            if (kind == node_kind::word) {
+                k.literal = static_cast<const word &>(*node).id();
+            } else {
+                if (kind != node_kind::optional) {
+                    second = std::move(results.back());
+                    results.pop_back();
+                }
+                first = std::move(results.back());
+                results.pop_back();
+                k.first = first.get();
+                k.second = second.get();
+            }
+            auto & entry = _nodes[k];
+            if (auto shared = entry.lock()) {
+                results.push_back(std::move(shared));
+                continue;
+            }
+            std::shared_ptr<grammer> shared = node;
+            if (node->first != first || node->second != second) {
+                shared = node->copy();
+                shared->first = first;
+                shared->second = second;
+                shared->invalidate_cache();
+            }
+            entry = shared;
+            results.push_back(std::move(shared));
+        }
+        return std::move(results.back());
+    }
+
+    auto collect() -> void {
+        for (auto it = _nodes.begin(); it != _nodes.end();) {
+            if (it->second.expired())
+                it = _nodes.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    auto size() const -> std::size_t {
+        return _nodes.size();
+    }
+
+private:
+    // Operands are identified by address. The address of a live entry's
+    // operand cannot be reused, because the entry's node keeps it alive.
+    struct key {
+        node_kind kind;
+        const grammer * first;
+        const grammer * second;
+        literal_id literal;
+
+        auto operator ==(const key & other) const -> bool {
+            return kind == other.kind && first == other.first && second == other.second && literal == other.literal;
+        }
+    };
+
+    struct key_hash {
+        auto operator ()(const key & k) const -> std::size_t {
+            std::size_t h = k.literal.value();
+            for (const auto value : {static_cast<std::size_t>(k.kind), std::hash<const grammer *>{}(k.first), std::hash<const grammer *>{}(k.second)})
+                h ^= value + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2);
+            return h;
+        }
+    };
+
+    std::unordered_map<key, std::weak_ptr<grammer>, key_hash> _nodes;
+};
+
+// Individual encoded as a flat prefix-order array of genes, the Polish
+// notation of the tree. Every opcode has a fixed arity, so a subtree is the
+// contiguous range that its arities close, and genetic operators are range
+// copies and in-place gene replacement without any pointers.
+class genome {
+public:
+    // empty stands for a missing operand.
+    enum class opcode : std::uint8_t {
+        join,
+        or_,
+        optional,
+        word,
+        empty
+    };
+
+    struct gene {
+        opcode op;
+        literal_id literal;
+    };
+
+    static auto arity(opcode op) -> std::size_t {
+        switch (op) {
+        case opcode::join:
+        case opcode::or_:
+            return 2;
+        case opcode::optional:
+            return 1;
+        case opcode::word:
+        case opcode::empty:
+            break;
+        }
+        return 0;
+    }
+
+    genome() {}
+
+    explicit genome(std::vector<gene> genes) : _genes{std::move(genes)} {
+        std::size_t open = 1;
+        for (const auto & g : _genes) {
+            if (!open)
+                throw std::invalid_argument("genes must encode exactly one tree.");
+            open += arity(g.op) - 1;
+        }
+        if (open)
+            throw std::invalid_argument("genes must encode exactly one tree.");
+    }
+
+    // Operands a node does not use are not encoded, as after optimize_tree.
+    explicit genome(const grammer & root) {
+        std::vector<const grammer *> stack{&root};
+        while (!stack.empty()) {
+            const auto * node = stack.back();
+            stack.pop_back();
+            if (!node) {
+                _genes.push_back({opcode::empty, literal_id{}});
+                continue;
+            }
+            switch (kind_of(*node)) {
+            case node_kind::join:
+                _genes.push_back({opcode::join, literal_id{}});
+                break;
+            case node_kind::or_:
+                _genes.push_back({opcode::or_, literal_id{}});
+                break;
+            case node_kind::optional:
+                _genes.push_back({opcode::optional, literal_id{}});
+                break;
+            case node_kind::word:
+                _genes.push_back({opcode::word, static_cast<const word &>(*node).id()});
+                break;
+            }
+            if (arity(_genes.back().op) == 2)
+                stack.push_back(node->second.get());
+            if (arity(_genes.back().op) >= 1)
+                stack.push_back(node->first.get());
+        }
+    }
+
+    auto genes() const -> const std::vector<gene> & {
+        return _genes;
+    }
+
+    // Number of genes in the subtree that starts at index.
+    auto extent(std::size_t index) const -> std::size_t {
+        std::size_t open = 1;
+        auto end = index;
+        while (open)
+            open += arity(_genes[end++].op) - 1;
+        return end - index;
+    }
+
+    // receiver with the subtree at target replaced by donor's subtree at
+    // source, built from three range copies.
+    static auto splice(const genome & receiver, std::size_t target, const genome & donor, std::size_t source) -> genome {
+        const auto receiver_begin = receiver._genes.begin();
+        const auto donor_begin = donor._genes.begin();
+        genome child;
+        child._genes.reserve(receiver._genes.size() - receiver.extent(target) + donor.extent(source));
+        child._genes.insert(child._genes.end(), receiver_begin, receiver_begin + target);
+        child._genes.insert(child._genes.end(), donor_begin + source, donor_begin + source + donor.extent(source));
+        child._genes.insert(child._genes.end(), receiver_begin + target + receiver.extent(target), receiver._genes.end());
+        return child;
+    }
+
+    // Swaps uniformly chosen nodes, like create_crossed_tree.
+    static auto crossover(const genome & a, const genome & b) -> std::pair<genome, genome> {
+        const auto i = a.random_node();
+        const auto j = b.random_node();
+        return {splice(a, i, b, j), splice(b, j, a, i)};
+    }
+
+    // Replaces a gene with one of the same arity, which keeps every range
+    // intact.
+    auto set_gene(std::size_t index, gene g) -> void {
+        if (arity(g.op) != arity(_genes[index].op))
+            throw std::invalid_argument("A gene can only be replaced by one of the same arity.");
+        _genes[index] = g;
+        _sizes.clear();
+    }
+
+    // Mutates a random node in place: join and or_ swap, and a word becomes
+    // another printable one-character word. optional, the only opcode of
+    // its arity, is toggled off and leaves its operand in its place, or gets
+    // a word if its operand is missing.
+    auto mutate() -> void {
+        const auto index = random_node();
+        auto & g = _genes[index];
+        switch (g.op) {
+        case opcode::join:
+            g.op = opcode::or_;
+            break;
+        case opcode::or_:
+            g.op = opcode::join;
+            break;
+        case opcode::optional:
+            if (_genes[index + 1].op == opcode::empty)
+                _genes[index + 1] = random_word();
+            else
+                _genes.erase(_genes.begin() + index);
+            break;
+        case opcode::word:
+        case opcode::empty:
+            g = random_word();
+            break;
+        }
+        _sizes.clear();
+    }
+
+    // Number of nodes on the longest path from the root to a leaf.
+    auto depth() const -> std::size_t {
+        // Each open operand slot holds the level of the node that fills it.
+        std::size_t max_depth = 0;
+        std::vector<std::size_t> slots{1};
+        for (const auto & g : _genes) {
+            const auto level = slots.back();
+            slots.pop_back();
+            if (g.op != opcode::empty)
+                max_depth = std::max(max_depth, level);
+            slots.insert(slots.end(), arity(g.op), level + 1);
+        }
+        return max_depth;
+    }
+
+    // Returns null for a genome that is a single missing operand.
+    auto to_grammer() const -> std::shared_ptr<grammer> {
+        // Genes are decoded right to left, so the operands of a node are on
+        // top of the stack when the node is reached.
+        std::vector<std::shared_ptr<grammer>> stack;
+        for (auto it = _genes.rbegin(); it != _genes.rend(); ++it) {
+            std::shared_ptr<grammer> node;
+            switch (it->op) {
+            case opcode::join:
+                node = make_node<join>();
+                break;
+            case opcode::or_:
+                node = make_node<or_>();
+                break;
+            case opcode::optional:
+                node = make_node<optional>();
+                break;
+            case opcode::word:
+                node = make_node<word>(it->literal);
+                break;
+            case opcode::empty:
+                break;
+            }
+            const auto n = arity(it->op);
+            if (n >= 1) {
+                node->first = std::move(stack.back());
+                stack.pop_back();
+            }
+            if (n >= 2) {
+                node->second = std::move(stack.back());
+                stack.pop_back();
+            }
+            stack.push_back(std::move(node));
+        }
+        return stack.empty() ? nullptr : stack.back();
+    }
+
+    // Same score and counters as grammer::evaluate on the decoded tree,
+    // without memoization, pruning or deterministic parsing. The parse runs
+    // as a loop over a task stack: a task parses one subtree at one position
+    // and hands each remainder to a continuation, which is either the
+    // result or the second operand of a pending join.
+    auto evaluate(std::string_view str, context & ctx) const -> double {
+        ctx.reset();
+        cache_attributes();
+        auto & continuations = _continuations;
+        auto & tasks = _tasks;
+        continuations.clear();
+        tasks.assign(1, {0, str, result});
+        const auto emit = [&](std::string_view rest, std::size_t next) {
+            if (next == result)
+                ctx.push(ctx.candidates, rest);
+            else
+                tasks.push_back({continuations[next].index, rest, continuations[next].next});
+        };
+        while (!tasks.empty()) {
+            const auto t = tasks.back();
+            tasks.pop_back();
+            const auto & g = _genes[t.index];
+            if (g.op == opcode::empty)
+                continue;
+            ctx.compare_count += _sizes[t.index];
+            const auto first = t.index + 1;
+            switch (g.op) {
+            case opcode::join: {
+                const auto second = first + _extents[first];
+                if (_genes[first].op == opcode::empty || _genes[second].op == opcode::empty)
+                    break;
+                continuations.push_back({second, t.next});
+                tasks.push_back({first, t.str, continuations.size() - 1});
+                break;
+            }
+            case opcode::or_:
+                tasks.push_back({first + _extents[first], t.str, t.next});
+                tasks.push_back({first, t.str, t.next});
+                break;
+            case opcode::optional:
+                emit(t.str, t.next);
+                tasks.push_back({first, t.str, t.next});
+                break;
+            case opcode::word: {
+                const auto lit = literal_pool::get(_genes[t.index].literal);
+                if (starts_with_literal(t.str, lit)) {
+                    ctx.match_count += 1;
+                    emit(t.str.substr(lit.size()), t.next);
+                }
+                break;
+            }
+            case opcode::empty:
+                break;
+            }
+        }
+        return grammer::score(grammer::match(ctx.candidates), ctx);
+    }
+
+private:
+    static constexpr std::size_t result = std::numeric_limits<std::size_t>::max();
+
+    struct continuation {
+        std::size_t index;
+        std::size_t next;
+    };
+
+    struct task {
+        std::size_t index;
+        std::string_view str;
+        std::size_t next;
+    };
+
+    static auto random_word() -> gene {
+        char c;
+        while (!std::isprint(c = static_cast<char>(random_integral<>(0, 0xff))));
+        return {opcode::word, literal_pool::instance().intern(std::string_view{&c, 1})};
+    }
+
+    // Index of a uniformly chosen gene that is not a missing operand.
+    auto random_node() const -> std::size_t {
+        const auto node_number = static_cast<std::size_t>(std::count_if(_genes.begin(), _genes.end(), [](const gene & g){
+            return g.op != opcode::empty;
+        }));
+        if (!node_number)
+            throw std::logic_error("genome has no nodes.");
+        auto k = random_integral<std::size_t>(0, node_number - 1);
+        for (std::size_t index = 0; ; ++index)
+            if (_genes[index].op != opcode::empty && !k--)
+                return index;
+    }
+
+    // grammer::size and the extent of every subtree, computed right to left
+    // with a stack of operand indices.
+    auto cache_attributes() const -> void {
+        if (_sizes.size() == _genes.size())
+            return;
+        _sizes.assign(_genes.size(), 0);
+        _extents.assign(_genes.size(), 1);
+        std::vector<std::size_t> stack;
+        for (auto index = _genes.size(); index-- > 0;) {
+            const auto n = arity(_genes[index].op);
+            std::size_t size = _genes[index].op == opcode::empty ? 0 : 1;
+            for (std::size_t i = 0; i < n; ++i) {
+                const auto operand = stack.back();
+                stack.pop_back();
+                size += _genes[index].op == opcode::optional ? 2 * _sizes[operand] : _sizes[operand];
+                _extents[index] += _extents[operand];
+            }
+            _sizes[index] = size;
+            stack.push_back(index);
+        }
+    }
+
+    std::vector<gene> _genes;
+    mutable std::vector<std::size_t> _sizes;
+    mutable std::vector<std::size_t> _extents;
+    mutable std::vector<continuation> _continuations;
+    mutable std::vector<task> _tasks;
+};
+
+template<typename Individual>
+auto select_individual(std::vector<evaluated<Individual>> & individuals) -> Individual {
     if (individuals.empty())
         throw std::logic_error("Individuals number must be not empty.");
     double sum = 0;
@@ -418,14 +4233,45 @@ auto split_line(std::string_view str) -> std::vector<std::string> {
     return results;
 }
 
+enum class evaluation_engine {
+    backtracking,
+    offset_set,
+    glushkov,
+    lazy_dfa,
+    pike_vm,
+    lockstep
+};
+
+// How generic_programming holds its population: linked grammer nodes, node
+// ranges of one population_store, or one genome per individual.
+enum class representation {
+    tree,
+    store,
+    genome
+};
+
 class generic_programming {
 public:
+    static constexpr std::size_t default_max_depth = 1024;
+
     generic_programming() {}
 
     auto init_grammer(std::size_t tree_number, std::size_t node_number) -> void {
-        _grammer_list.resize(tree_number);
-        for (auto & ptr : _grammer_list)
-            ptr = generate_tree(node_number);
+        std::vector<std::shared_ptr<grammer>> population(tree_number);
+        for (auto & ptr : population)
+            ptr = generate_tree(node_number, _max_depth);
+        assign_population(std::move(population));
+    }
+
+    // The current population is carried over into the new representation.
+    auto set_representation(representation r) -> void {
+        if (r != representation::tree && (_generational_arena || _persistent_trees || _subtree_sharing))
+            throw std::logic_error("Only representation::tree can be combined with generational_arena, persistent_trees or subtree_sharing.");
+        std::vector<std::shared_ptr<grammer>> population;
+        for (std::size_t i = 0; i < population_size(); ++i)
+            population.push_back(individual(i));
+        _representation = r;
+        assign_population(std::move(population));
     }
 
     auto set_elite_ratio(double elite_ratio) -> void {
@@ -448,6 +4294,75 @@ public:
         _max_unmodified_count = max_unmodified_count;
     }
 
+    auto set_memoization(bool memoization) -> void {
+        _memoization = memoization;
+    }
+
+    auto set_evaluation_engine(evaluation_engine engine) -> void {
+        _engine = engine;
+    }
+
+    auto set_length_pruning(bool length_pruning) -> void {
+        _length_pruning = length_pruning;
+    }
+
+    auto set_deterministic_parsing(bool deterministic_parsing) -> void {
+        _deterministic_parsing = deterministic_parsing;
+    }
+
+    auto set_fitness_function(fitness_function fitness) -> void {
+        _fitness = fitness;
+    }
+
+    auto set_prefilter(bool prefilter) -> void {
+        _prefilter = prefilter;
+    }
+
+    // Trees generated by init_grammer stay within max_depth, and offspring
+    // of crossover and mutation deeper than it are replaced by their first
+    // parent. Parsing recurses once per level, so this bounds its stack
+    // usage.
+    auto set_max_depth(std::size_t max_depth) -> void {
+        if (max_depth == 0)
+            throw std::invalid_argument("max_depth must be greater than zero.");
+        _max_depth = max_depth;
+    }
+
+    auto set_generational_arena(bool generational_arena) -> void {
+        if (generational_arena && _representation != representation::tree)
+            throw std::logic_error("generational_arena requires representation::tree.");
+        if (generational_arena && _subtree_sharing)
+            throw std::logic_error("generational_arena cannot be combined with subtree_sharing.");
+        if (_generational_arena && !generational_arena) {
+            // Moves the population to the heap so that the arenas empty and
+            // can be reset if they are enabled again.
+            node_arena::scope heap{nullptr};
+            for (auto & grm : _grammer_list)
+                grm = grm->clone();
+            _dfa_cache.clear();
+        }
+        _generational_arena = generational_arena;
+    }
+
+    auto set_persistent_trees(bool persistent_trees) -> void {
+        if (persistent_trees && _representation != representation::tree)
+            throw std::logic_error("persistent_trees requires representation::tree.");
+        _persistent_trees = persistent_trees;
+    }
+
+    auto set_subtree_sharing(bool subtree_sharing) -> void {
+        if (subtree_sharing && _representation != representation::tree)
+            throw std::logic_error("subtree_sharing requires representation::tree.");
+        if (subtree_sharing && _generational_arena)
+            throw std::logic_error("subtree_sharing cannot be combined with generational_arena.");
+        _subtree_sharing = subtree_sharing;
+    }
+
+    auto set_dfa_cache_size(std::size_t dfa_cache_size) -> void {
+        _dfa_cache_size = dfa_cache_size;
+        _dfa_cache.clear();
+    }
+
     auto print_input() const -> void {
         for (const auto & input : _input_list)
             std::cout << input << std::endl;
@@ -463,7 +4378,7 @@ public:
                 if (unmodified_count > _max_unmodified_count)
                     break;
             } else {
-                std::cout << *_grammer_list[0] << std::endl;
+                std::cout << *individual(0) << std::endl;
                 unmodified_count = 0;
                 prev_eval = eval;
             }
@@ -471,9 +4386,24 @@ public:
     }
 
     auto update() -> double {
+        if (_representation == representation::store)
+            return update_store();
+        if (_representation == representation::genome)
+            return update_genomes();
+
+        // Structurally equal trees, such as elite copies, are evaluated once
+        // per generation.
+        std::unordered_map<std::uint64_t, std::vector<std::pair<const grammer *, double>>> evaluation_values;
         std::vector<evaluated<std::shared_ptr<grammer>>> evaluated_grammers;
-        for (const auto & grm : _grammer_list)
-            evaluated_grammers.emplace_back(grm, evaluate(*grm));
+        for (const auto & grm : _grammer_list) {
+            auto & candidates = evaluation_values[grm->hash()];
+            auto found = std::find_if(candidates.begin(), candidates.end(), [&](const auto & candidate){
+                return candidate.first->equals(*grm);
+            });
+            if (found == candidates.end())
+                found = candidates.emplace(candidates.end(), grm.get(), evaluate(grm));
+            evaluated_grammers.emplace_back(grm, found->second);
+        }
 
         std::sort(std::begin(evaluated_grammers), std::end(evaluated_grammers), [](auto && a, auto && b){
             return a.second > b.second;
@@ -485,29 +4415,88 @@ public:
 
         std::vector<std::shared_ptr<grammer>> next_generation;
 
+        // Offspring go to the arena that held the previous generation. Its
+        // survivors were moved out in the last update, so reset throws only
+        // if a node of that generation is still referenced.
+        node_arena * arena = nullptr;
+        if (_generational_arena) {
+            _arenas[_arena_index ^ 1].reset();
+            _arena_index ^= 1;
+            arena = &_arenas[_arena_index];
+        }
+        node_arena::scope scope{arena};
+
         const std::size_t elite_number = static_cast<std::size_t>(std::floor(_elite_ratio * _grammer_list.size()));
         for (std::size_t i = 0; i < elite_number; ++i)
             next_generation.push_back(evaluated_grammers[i].first);
 
         const std::size_t mutation_number = static_cast<std::size_t>(std::floor(_mutation_ratio * _grammer_list.size()));
         for (std::size_t i = 0; i < mutation_number; ++i) {
-            auto clone = select_individual(rankinged_grammers)->clone();
-            auto node = random_select_node(clone);
-            mutate_node(node);
-            next_generation.push_back(clone);
+            auto parent = select_individual(rankinged_grammers);
+            std::shared_ptr<grammer> child;
+            if (_persistent_trees) {
+                child = create_shared_mutated_tree(parent);
+            } else {
+                child = parent->clone();
+                const auto path = random_node_path(child);
+                mutate_node(const_cast<std::shared_ptr<grammer> &>(*path.back()));
+                invalidate_path(path);
+            }
+            if (depth(*child) > _max_depth)
+                child = parent;
+            next_generation.push_back(child);
         }
 
         for (std::size_t i = next_generation.size(); i < _grammer_list.size(); ++i) {
             auto parent_a = select_individual(rankinged_grammers);
             auto parent_b = select_individual(rankinged_grammers);
-            next_generation.push_back(create_crossed_tree(parent_a, parent_b).first);
+            auto child = _persistent_trees
+                ? create_shared_crossed_tree(parent_a, parent_b).first
+                : create_crossed_tree(parent_a, parent_b).first;
+            if (depth(*child) > _max_depth)
+                child = parent_a;
+            next_generation.push_back(child);
         }
 
         for (auto & grm : next_generation)
             optimize_tree(grm);
 
+        if (_subtree_sharing) {
+            for (auto & grm : next_generation)
+                grm = _subtrees.intern(grm);
+            _subtrees.collect();
+        }
+
+        // Elites and subtrees shared with parents still live in the current
+        // generation's arena, so they are moved into the new one.
+        if (arena)
+            evacuate(next_generation, *arena);
+
         std::swap(_grammer_list, next_generation);
 
+        // Cached automata follow their trees by structure, so elites cloned
+        // into a new arena keep them. Each kept entry is rebound to a tree of
+        // the new generation, and the others are dropped.
+        decltype(_dfa_cache) dfa_cache;
+        for (const auto & grm : _grammer_list) {
+            const auto range = _dfa_cache.equal_range(grm->hash());
+            for (auto it = range.first; it != range.second; ++it) {
+                if (!it->second.first->equals(*grm))
+                    continue;
+                it->second.first = grm;
+                dfa_cache.emplace(it->first, std::move(it->second));
+                _dfa_cache.erase(it);
+                break;
+            }
+        }
+        _dfa_cache = std::move(dfa_cache);
+
+        if (!_best_grammer || evaluated_grammers[0].second > _best_evaluation_value) {
+            node_arena::scope heap{nullptr};
+            _best_grammer = arena ? evaluated_grammers[0].first->clone() : evaluated_grammers[0].first;
+            _best_evaluation_value = evaluated_grammers[0].second;
+        }
+
         double max_evaluation_value = evaluated_grammers[0].second;
         return max_evaluation_value;
     }
@@ -527,31 +4516,372 @@ public:
         // TODO
     }
 
+    auto write_recognizer(std::string_view path) const -> void {
+        if (!_best_grammer)
+            throw std::logic_error("No grammer has been evaluated yet.");
+        std::ofstream out{std::string(path)};
+        grammergen::write_recognizer(*_best_grammer, out);
+    }
+
+    // Node allocations of the last generation when the generational arena is
+    // enabled. block_count drops to zero once the arenas have warmed up.
+    auto arena_statistics() const -> const node_arena::statistics & {
+        return _arenas[_arena_index].stats();
+    }
+
+    // Buffer growths of the evaluation context since construction. It stops
+    // increasing once the buffers fit the corpus, unless memoization is on.
+    auto allocation_count() const -> std::size_t {
+        return _context.allocation_count;
+    }
+
     auto print_grammer() const -> void {
-        for (const auto & grm : _grammer_list)
-            std::cout << *grm << std::endl;
+        for (std::size_t i = 0; i < population_size(); ++i)
+            std::cout << *individual(i) << std::endl;
     }
 
     auto append_input(std::string_view str)
         -> void
     {
         _input_list.emplace_back(str);
+        _input_batches.clear();
     }
 
 private:
-    auto evaluate(const grammer & grm) const -> double {
+    auto population_size() const -> std::size_t {
+        switch (_representation) {
+        case representation::store:
+            return _store_trees.size();
+        case representation::genome:
+            return _genomes.size();
+        default:
+            return _grammer_list.size();
+        }
+    }
+
+    auto individual(std::size_t index) const -> std::shared_ptr<grammer> {
+        switch (_representation) {
+        case representation::store:
+            return _store.to_grammer(_store_trees[index].begin);
+        case representation::genome:
+            return _genomes[index].to_grammer();
+        default:
+            return _grammer_list[index];
+        }
+    }
+
+    auto assign_population(std::vector<std::shared_ptr<grammer>> population) -> void {
+        _grammer_list.clear();
+        _store = population_store{};
+        _store_trees.clear();
+        _genomes.clear();
+        switch (_representation) {
+        case representation::tree:
+            _grammer_list = std::move(population);
+            break;
+        case representation::store:
+            for (const auto & grm : population)
+                _store_trees.push_back(_store.add(*grm));
+            break;
+        case representation::genome:
+            for (const auto & grm : population)
+                _genomes.emplace_back(*grm);
+            break;
+        }
+    }
+
+    // Generation step of the representations other than tree, as update
+    // performs it on linked trees: decode, mutate, cross and depth_of act on
+    // single individuals. Returns the next generation, elites first, and
+    // the best evaluation value of the current one.
+    template<typename Individual, typename Decode, typename Mutate, typename Cross, typename Depth>
+    auto evolve(const std::vector<Individual> & population, Decode decode, Mutate mutate, Cross cross, Depth depth_of)
+        -> std::pair<std::vector<Individual>, double>
+    {
+        std::vector<evaluated<const Individual *>> evaluated_individuals;
+        for (const auto & ind : population)
+            evaluated_individuals.emplace_back(&ind, evaluate(ind));
+
+        std::sort(std::begin(evaluated_individuals), std::end(evaluated_individuals), [](auto && a, auto && b){
+            return a.second > b.second;
+        });
+
+        std::vector<evaluated<const Individual *>> rankinged_individuals;
+        for (std::size_t i = 0; i < evaluated_individuals.size(); ++i)
+            rankinged_individuals.emplace_back(evaluated_individuals[i].first, evaluated_individuals.size() - i);
+
+        if (!_best_grammer || evaluated_individuals[0].second > _best_evaluation_value) {
+            _best_grammer = decode(*evaluated_individuals[0].first);
+            _best_evaluation_value = evaluated_individuals[0].second;
+        }
+
+        std::vector<Individual> next_generation;
+
+        const std::size_t elite_number = static_cast<std::size_t>(std::floor(_elite_ratio * population.size()));
+        for (std::size_t i = 0; i < elite_number; ++i)
+            next_generation.push_back(*evaluated_individuals[i].first);
+
+        const std::size_t mutation_number = static_cast<std::size_t>(std::floor(_mutation_ratio * population.size()));
+        for (std::size_t i = 0; i < mutation_number; ++i) {
+            const auto & parent = *select_individual(rankinged_individuals);
+            auto child = mutate(parent);
+            next_generation.push_back(depth_of(child) > _max_depth ? parent : std::move(child));
+        }
+
+        for (std::size_t i = next_generation.size(); i < population.size(); ++i) {
+            const auto & parent_a = *select_individual(rankinged_individuals);
+            const auto & parent_b = *select_individual(rankinged_individuals);
+            auto child = cross(parent_a, parent_b);
+            next_generation.push_back(depth_of(child) > _max_depth ? parent_a : std::move(child));
+        }
+
+        return {std::move(next_generation), evaluated_individuals[0].second};
+    }
+
+    // Elites keep their ranges, offspring are appended, and compact then
+    // drops the nodes of the previous generation.
+    auto update_store() -> double {
+        const auto random_node = [](population_store::tree t) {
+            return random_integral<std::uint32_t>(t.begin, t.end - 1);
+        };
+        auto [next_generation, max_evaluation_value] = evolve(
+            _store_trees,
+            [&](population_store::tree t) {
+                return _store.to_grammer(t.begin);
+            },
+            [&](population_store::tree t) {
+                const auto node = generate_node();
+                const auto k = kind_of(*node);
+                return _store.mutate(t, random_node(t), k,
+                    k == node_kind::word ? static_cast<const word &>(*node).id() : literal_id{});
+            },
+            [&](population_store::tree a, population_store::tree b) {
+                return _store.crossover(a, random_node(a), random_node(b));
+            },
+            [&](population_store::tree t) {
+                return _store.depth(t.begin);
+            }
+        );
+        _store.compact(next_generation);
+        _store_trees = std::move(next_generation);
+        // Cached automata belong to decoded trees, which are not kept.
+        _dfa_cache.clear();
+        return max_evaluation_value;
+    }
+
+    auto update_genomes() -> double {
+        auto [next_generation, max_evaluation_value] = evolve(
+            _genomes,
+            [](const genome & g) {
+                return g.to_grammer();
+            },
+            [](const genome & g) {
+                auto child = g;
+                child.mutate();
+                return child;
+            },
+            [](const genome & a, const genome & b) {
+                return genome::crossover(a, b).first;
+            },
+            [](const genome & g) {
+                return g.depth();
+            }
+        );
+        _genomes = std::move(next_generation);
+        _dfa_cache.clear();
+        return max_evaluation_value;
+    }
+
+    // The default configuration is evaluated natively by the store and
+    // genome representations, which decode the tree for every other engine
+    // and option.
+    auto native_evaluation() const -> bool {
+        return _engine == evaluation_engine::backtracking && _fitness == fitness_function::match_count
+            && !_memoization && !_length_pruning && !_deterministic_parsing && !_prefilter;
+    }
+
+    auto evaluate(population_store::tree t) -> double {
+        if (!native_evaluation())
+            return evaluate(_store.to_grammer(t.begin));
+        _context.memoize = _context.prune = _context.deterministic = false;
+        double value = 0;
+        for (const auto & input : _input_list)
+            value += _store.evaluate(t, input, _context);
+        return value;
+    }
+
+    auto evaluate(const genome & g) -> double {
+        if (!native_evaluation())
+            return evaluate(g.to_grammer());
+        _context.memoize = _context.prune = _context.deterministic = false;
         double value = 0;
         for (const auto & input : _input_list)
-            value += grm.evaluate(input);
+            value += g.evaluate(input, _context);
+        return value;
+    }
+
+    // Copies the nodes of trees that live outside arena into the current
+    // arena and relinks the nodes inside it to the copies. Each node is
+    // copied once, so subtrees shared between trees stay shared, and the
+    // copies keep their cached attributes since the structure is unchanged.
+    static auto evacuate(std::vector<std::shared_ptr<grammer>> & trees, const node_arena & arena) -> void {
+        std::unordered_map<const grammer *, std::shared_ptr<grammer>> moved;
+        std::unordered_set<const grammer *> relinked;
+        const auto target = [&](const std::shared_ptr<grammer> & node) -> const std::shared_ptr<grammer> & {
+            return node && !arena.owns(node.get()) ? moved.at(node.get()) : node;
+        };
+        std::vector<std::pair<const grammer *, bool>> stack;
+        for (const auto & grm : trees)
+            stack.emplace_back(grm.get(), false);
+        while (!stack.empty()) {
+            const auto [node, expanded] = stack.back();
+            const bool owned = arena.owns(node);
+            if (expanded) {
+                stack.pop_back();
+                auto copy = owned ? nullptr : node->copy();
+                auto * relinked_node = owned ? const_cast<grammer *>(node) : copy.get();
+                for (auto * operand : {&relinked_node->first, &relinked_node->second})
+                    if (*operand)
+                        *operand = target(*operand);
+                if (copy)
+                    moved.emplace(node, std::move(copy));
+                continue;
+            }
+            if (owned ? !relinked.insert(node).second : moved.count(node) != 0) {
+                stack.pop_back();
+                continue;
+            }
+            stack.back().second = true;
+            for (const auto * operand : {node->first.get(), node->second.get()})
+                if (operand)
+                    stack.emplace_back(operand, false);
+        }
+        for (auto & grm : trees)
+            grm = target(grm);
+    }
+
+    auto evaluate(const std::shared_ptr<grammer> & grm) -> double {
+        auto & ctx = _context;
+        ctx.memoize = _memoization;
+        ctx.prune = _length_pruning;
+        ctx.deterministic = _deterministic_parsing;
+        double value = 0;
+        if (_fitness != fitness_function::match_count) {
+            const glushkov_nfa nfa{*grm};
+            for (const auto & input : _input_list)
+                value += nfa.evaluate(input, ctx, _fitness);
+            return value;
+        }
+        std::unique_ptr<prefilter> filter;
+        if (_prefilter)
+            filter = std::make_unique<prefilter>(*grm);
+        // Inputs that cannot match fully only earn the prefilter's credit.
+        auto admit = [&](const std::string & input) {
+            if (!filter || filter->can_match(input))
+                return true;
+            value += filter->partial_credit(input);
+            return false;
+        };
+        if (_engine == evaluation_engine::glushkov) {
+            const glushkov_nfa nfa{*grm};
+            for (const auto & input : _input_list)
+                if (admit(input))
+                    value += nfa.evaluate(input, ctx);
+            return value;
+        }
+        if (_engine == evaluation_engine::lazy_dfa) {
+            lazy_dfa * dfa = nullptr;
+            const auto range = _dfa_cache.equal_range(grm->hash());
+            for (auto it = range.first; it != range.second && !dfa; ++it)
+                if (it->second.first->equals(*grm))
+                    dfa = it->second.second.get();
+            if (!dfa)
+                dfa = _dfa_cache.emplace(
+                    grm->hash(),
+                    std::make_pair(grm, std::make_unique<grammergen::lazy_dfa>(*grm, _dfa_cache_size))
+                )->second.second.get();
+            for (const auto & input : _input_list)
+                if (admit(input))
+                    value += dfa->evaluate(input, ctx);
+            return value;
+        }
+        if (_engine == evaluation_engine::lockstep) {
+            if (_input_batches.empty())
+                for (std::size_t i = 0; i < _input_list.size(); i += input_batch::lane_number)
+                    _input_batches.emplace_back(
+                        _input_list.data() + i,
+                        std::min(input_batch::lane_number, _input_list.size() - i)
+                    );
+            const lockstep_nfa nfa{*grm};
+            for (std::size_t i = 0; i < _input_batches.size(); ++i) {
+                std::uint32_t lanes = 0;
+                for (std::size_t lane = 0; lane < input_batch::lane_number; ++lane) {
+                    const auto index = i * input_batch::lane_number + lane;
+                    if (index < _input_list.size() && admit(_input_list[index]))
+                        lanes |= std::uint32_t{1} << lane;
+                }
+                if (lanes)
+                    value += nfa.evaluate(_input_batches[i], lanes);
+            }
+            return value;
+        }
+        if (_engine == evaluation_engine::pike_vm) {
+            grammergen::pike_vm vm{*grm};
+            for (const auto & input : _input_list)
+                if (admit(input))
+                    value += vm.evaluate(input, ctx);
+            return value;
+        }
+        const flat_tree tree{*grm};
+        for (const auto & input : _input_list) {
+            if (!admit(input))
+                continue;
+            switch (_engine) {
+            case evaluation_engine::backtracking:
+                value += tree.evaluate(input, ctx);
+                break;
+            case evaluation_engine::offset_set:
+                value += tree.evaluate_offsets(input, ctx);
+                break;
+            default:
+                break;
+            }
+        }
         return value;
     }
 
+    // Declared first so that nodes allocated in them are released before
+    // the arenas are destroyed.
+    std::array<node_arena, 2> _arenas;
+    std::size_t _arena_index{};
     std::vector<std::string> _input_list;
+    std::vector<input_batch> _input_batches;
     std::vector<std::shared_ptr<grammer>> _grammer_list;
+    representation _representation{representation::tree};
+    population_store _store;
+    std::vector<population_store::tree> _store_trees;
+    std::vector<genome> _genomes;
+    std::shared_ptr<grammer> _best_grammer;
+    double _best_evaluation_value{};
     double _elite_ratio{};
     double _mutation_ratio{};
     std::size_t _max_unmodified_count{};
+    bool _memoization{};
+    evaluation_engine _engine{evaluation_engine::backtracking};
+    bool _prefilter{};
+    bool _length_pruning{};
+    bool _deterministic_parsing{};
+    std::size_t _max_depth{default_max_depth};
+    bool _generational_arena{};
+    bool _persistent_trees{};
+    bool _subtree_sharing{};
+    subtree_table _subtrees;
+    fitness_function _fitness{fitness_function::match_count};
+    std::size_t _dfa_cache_size{lazy_dfa::default_cache_size};
+    // Keyed by structural hash; each entry keeps a tree of its structure.
+    std::unordered_multimap<std::uint64_t, std::pair<std::shared_ptr<grammer>, std::unique_ptr<lazy_dfa>>> _dfa_cache;
     std::set<std::string> _dictionary;
+    context _context;
 };
 
 } // namespace grammergen
@@ -0,0 +1,338 @@
+#include "grammergen.hpp"
+
+// Randomized equivalence checks of every evaluation engine against the
+// backtracking parser. Inputs are drawn from the trees themselves so that a
+// fair share of them match. Prints the first mismatches and fails if there
+// are any.
+
+using namespace grammergen;
+
+namespace {
+
+std::size_t failure_number = 0;
+
+auto fail(const std::string & check, const grammer & root, std::string_view str) -> void {
+    if (++failure_number <= 10)
+        std::cerr << check << ": " << root << " [" << str << "]" << std::endl;
+}
+
+auto sample(const grammer & node, std::string & out) -> void {
+    switch (kind_of(node)) {
+    case node_kind::word:
+        out += static_cast<const word &>(node).literal();
+        break;
+    case node_kind::join:
+        if (node.first)
+            sample(*node.first, out);
+        if (node.second)
+            sample(*node.second, out);
+        break;
+    case node_kind::or_:
+        if (node.first && (!node.second || random_integral(0, 1)))
+            sample(*node.first, out);
+        else if (node.second)
+            sample(*node.second, out);
+        break;
+    case node_kind::optional:
+        if (node.first && random_integral(0, 1))
+            sample(*node.first, out);
+        break;
+    }
+}
+
+auto make_inputs(const grammer & root) -> std::vector<std::string> {
+    std::vector<std::string> inputs{"", "a", "ab", "This is a pen.", std::string(80, 'a')};
+    for (int i = 0; i < 6; ++i) {
+        std::string str;
+        sample(root, str);
+        inputs.push_back(str);
+        if (!str.empty()) {
+            inputs.push_back(str.substr(0, str.size() - 1));
+            inputs.push_back(str.substr(1));
+        }
+        inputs.push_back(str + str);
+        inputs.push_back(str + "a");
+    }
+    return inputs;
+}
+
+// Replaces some words with literals of up to six bytes, so that both packed
+// and pooled literal_ids occur.
+auto lengthen_words(std::shared_ptr<grammer> & root) -> void {
+    for (auto & slot : get_nodes(root)) {
+        if (kind_of(*slot.get()) != node_kind::word || random_integral(0, 1))
+            continue;
+        std::string lit(random_integral<std::size_t>(0, 6), 'a');
+        for (auto & c : lit)
+            c = static_cast<char>(random_integral('a', 'c'));
+        slot.get() = std::make_shared<word>(lit);
+    }
+    for (auto & node : get_nodes(root))
+        node.get()->invalidate_cache();
+}
+
+auto check_engines(std::size_t tree_number) -> void {
+    for (std::size_t i = 0; i < tree_number; ++i) {
+        auto root = generate_tree(random_integral<std::size_t>(1, 60));
+        if (i % 3 == 2)
+            lengthen_words(root);
+        if (i % 2)
+            optimize_tree(root);
+        const auto inputs = make_inputs(*root);
+
+        flat_tree flat{*root};
+        glushkov_nfa nfa{*root};
+        lazy_dfa lazy{*root, i % 3 ? lazy_dfa::default_cache_size : 4096};
+        pike_vm vm{*root};
+        lockstep_nfa lockstep{*root};
+        dfa automaton{*root};
+        prefilter filter{*root};
+        population_store store;
+        const auto stored = store.add(*root);
+        const genome genes{*root};
+
+        std::vector<lockstep_nfa::counters> lane_counters(input_batch::lane_number);
+        const auto batch_size = std::min(inputs.size(), input_batch::lane_number);
+        input_batch batch{inputs.data(), batch_size};
+        const auto lanes = lockstep.recognize(batch, lane_counters.data());
+
+        for (std::size_t k = 0; k < inputs.size(); ++k) {
+            const std::string_view str = inputs[k];
+
+            context backtracking;
+            const auto candidates = root->parse(str, backtracking);
+            const bool matched = grammer::match(candidates);
+            const bool member = std::any_of(candidates.begin(), candidates.end(), [](auto rest) {
+                return rest.empty();
+            });
+
+            for (int mode = 0; mode < 4; ++mode) {
+                context a, b;
+                a.memoize = b.memoize = mode & 1;
+                a.prune = b.prune = mode & 2;
+                if (root->evaluate(str, a) != flat.evaluate(str, b)
+                    || a.match_count != b.match_count || a.compare_count != b.compare_count)
+                    fail("flat_tree", *root, str);
+                if (root->evaluate_offsets(str, a) != flat.evaluate_offsets(str, b)
+                    || a.match_count != b.match_count || a.compare_count != b.compare_count)
+                    fail("flat_tree offsets", *root, str);
+            }
+
+            context tree_context, store_context;
+            if (root->evaluate(str, tree_context) != store.evaluate(stored, str, store_context)
+                || tree_context.match_count != store_context.match_count
+                || tree_context.compare_count != store_context.compare_count)
+                fail("population_store", *root, str);
+
+            context genome_context;
+            if (genes.evaluate(str, genome_context) != root->evaluate(str, tree_context)
+                || tree_context.match_count != genome_context.match_count
+                || tree_context.compare_count != genome_context.compare_count)
+                fail("genome", *root, str);
+
+            context offsets_context;
+            if (grammer::match(root->parse_offsets(str, 0, offsets_context), str.size()) != matched)
+                fail("offset_set", *root, str);
+
+            context nfa_context;
+            if (nfa.recognize(str, nfa_context) != matched)
+                fail("glushkov", *root, str);
+
+            for (int repeat = 0; repeat < 2; ++repeat) {
+                context lazy_context;
+                if (lazy.recognize(str, lazy_context) != matched
+                    || lazy_context.match_count != nfa_context.match_count
+                    || lazy_context.compare_count != nfa_context.compare_count)
+                    fail("lazy_dfa", *root, str);
+            }
+
+            context vm_context;
+            if (vm.recognize(str, vm_context) != matched
+                || vm_context.match_count != nfa_context.match_count
+                || vm_context.compare_count != nfa_context.compare_count)
+                fail("pike_vm", *root, str);
+
+            if (k < batch_size) {
+                const auto & lane = lane_counters[k];
+                if (((lanes >> k) & 1) != matched
+                    || lane.match_count != nfa_context.match_count
+                    || lane.compare_count != nfa_context.compare_count)
+                    fail("lockstep", *root, str);
+            }
+
+            if (automaton.match(str) != member)
+                fail("dfa", *root, str);
+
+            if (!filter.can_match(str) && member)
+                fail("prefilter", *root, str);
+        }
+    }
+}
+
+// The copy has the used operand slots of the source, filled or not, and
+// nothing in the others.
+auto same_shape(const grammer & source, const grammer & copy) -> bool {
+    if (kind_of(source) != kind_of(copy))
+        return false;
+    const grammer * source_operands[] = {source.first.get(), source.second.get()};
+    const grammer * copy_operands[] = {copy.first.get(), copy.second.get()};
+    for (std::size_t i = 0; i < 2; ++i) {
+        if (i >= source.operand_number() || !source_operands[i]) {
+            if (copy_operands[i])
+                return false;
+        } else if (!copy_operands[i] || !same_shape(*source_operands[i], *copy_operands[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+auto check_clone(std::size_t tree_number) -> void {
+    std::vector<std::shared_ptr<grammer>> roots{
+        std::make_shared<optional>(nullptr, std::make_shared<word>("x")),
+        std::make_shared<optional>(std::make_shared<word>("a"), std::make_shared<word>("x")),
+        std::make_shared<join>(nullptr, std::make_shared<word>("x")),
+    };
+    auto stray = std::make_shared<word>("a");
+    stray->first = std::make_shared<word>("x");
+    roots.push_back(stray);
+    for (std::size_t i = 0; i < tree_number; ++i)
+        roots.push_back(generate_tree(random_integral<std::size_t>(1, 60)));
+    for (const auto & root : roots) {
+        const auto copy = root->clone();
+        if (!same_shape(*root, *copy) || !copy->equals(*root) || copy->hash() != root->hash())
+            fail("clone", *root, "");
+    }
+}
+
+auto check_literals(std::size_t literal_number) -> void {
+    for (std::size_t i = 0; i < literal_number; ++i) {
+        std::string lit(random_integral<std::size_t>(0, 8), 'a');
+        for (auto & c : lit)
+            c = static_cast<char>(random_integral(0, 0xff));
+        const word w{lit};
+        const auto copy = w.copy();
+        const auto id = literal_pool::instance().intern(lit);
+        if (w.literal() != lit || static_cast<const word &>(*copy).literal() != lit || id != w.id()
+            || literal_pool::get(id) != lit || id.is_packed() != (lit.size() <= literal_id::packed_size))
+            fail("literal", w, lit);
+        const auto longer = literal_pool::instance().intern(lit + "x");
+        const auto shorter = literal_pool::instance().intern(lit.substr(0, lit.size() / 2));
+        if (longer == id || (!lit.empty() && shorter == id))
+            fail("literal identity", w, lit);
+    }
+}
+
+// node_count agrees with get_nodes, and random_node_path descends through
+// operand slots from the root.
+auto check_node_path(std::size_t tree_number) -> void {
+    for (std::size_t i = 0; i < tree_number; ++i) {
+        auto root = generate_tree(random_integral<std::size_t>(1, 60));
+        if (i % 2)
+            optimize_tree(root);
+        if (root->node_count() != get_nodes(root).size())
+            fail("node_count", *root, "");
+        const auto path = random_node_path(root);
+        for (std::size_t k = 0; k + 1 < path.size(); ++k)
+            if (&(*path[k])->first != path[k + 1] && &(*path[k])->second != path[k + 1])
+                fail("random_node_path", *root, "");
+        if (path.front() != &root || !*path.back())
+            fail("random_node_path", *root, "");
+    }
+}
+
+// A warmed up context evaluates again without allocating, also when pruning
+// credits the skipped subtrees.
+auto check_pruned_allocation(std::size_t tree_number) -> void {
+    for (std::size_t i = 0; i < tree_number; ++i) {
+        const auto root = generate_tree(random_integral<std::size_t>(1, 60));
+        const flat_tree flat{*root};
+        const auto inputs = make_inputs(*root);
+        context a, b;
+        a.prune = b.prune = true;
+        for (const auto & str : inputs) {
+            root->evaluate(str, a);
+            flat.evaluate(str, b);
+        }
+        const auto tree_allocations = a.allocation_count;
+        const auto flat_allocations = b.allocation_count;
+        for (const auto & str : inputs) {
+            root->evaluate(str, a);
+            flat.evaluate(str, b);
+        }
+        if (a.allocation_count != tree_allocations || b.allocation_count != flat_allocations)
+            fail("pruned allocation", *root, "");
+    }
+}
+
+// population_store::mutate against mutate_node and optimize_tree on the
+// same node of a linked copy.
+auto check_store_mutation(std::size_t tree_number) -> void {
+    for (std::size_t i = 0; i < tree_number; ++i) {
+        auto root = generate_tree(random_integral<std::size_t>(1, 40));
+        optimize_tree(root);
+        population_store store;
+        const auto stored = store.add(*root);
+        const auto target = random_integral<std::uint32_t>(stored.begin, stored.end - 1);
+
+        auto expected = root->clone();
+        auto & slot = get_nodes(expected)[target - stored.begin].get();
+        mutate_node(slot);
+        const auto k = kind_of(*slot);
+        const auto literal = k == node_kind::word ? static_cast<const word &>(*slot).id() : literal_id{};
+        for (auto & node : get_nodes(expected))
+            node.get()->invalidate_cache();
+        optimize_tree(expected);
+
+        const auto mutated = store.mutate(stored, target, k, literal);
+        if (!store.to_grammer(mutated.begin)->equals(*expected) || store.depth(mutated.begin) != depth(*expected))
+            fail("population_store mutation", *root, "");
+        if (!store.to_grammer(stored.begin)->equals(*root))
+            fail("population_store mutation source", *root, "");
+    }
+}
+
+// Mutated genomes still encode one tree, of the depth they report, and
+// evaluate like it.
+auto check_genome_mutation(std::size_t tree_number) -> void {
+    const std::string inputs[] = {"", "a", "ab", "This is a pen."};
+    for (std::size_t i = 0; i < tree_number; ++i) {
+        auto root = generate_tree(random_integral<std::size_t>(1, 40));
+        genome genes{*root};
+        for (int k = 0; k < 5; ++k) {
+            genes.mutate();
+            const auto decoded = genes.to_grammer();
+            try {
+                genome{genes.genes()};
+            } catch (const std::invalid_argument &) {
+                fail("genome mutation", *root, "");
+                break;
+            }
+            if (genes.depth() != depth(*decoded))
+                fail("genome depth", *decoded, "");
+            for (const auto & str : inputs) {
+                context a, b;
+                if (genes.evaluate(str, a) != decoded->evaluate(str, b))
+                    fail("genome mutation evaluation", *decoded, str);
+            }
+        }
+    }
+}
+
+} // namespace
+
+int main() {
+    check_engines(3000);
+    check_clone(3000);
+    check_literals(3000);
+    check_node_path(3000);
+    check_pruned_allocation(1000);
+    check_store_mutation(3000);
+    check_genome_mutation(3000);
+    if (failure_number) {
+        std::cerr << failure_number << " checks failed." << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << "All checks passed." << std::endl;
+    return EXIT_SUCCESS;
+}